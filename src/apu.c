@@ -0,0 +1,684 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "apu.h"
+
+#define PULSE_WEIGHT    0.00752f
+#define TRIANGLE_WEIGHT 0.00851f
+#define NOISE_WEIGHT    0.00494f
+#define DMC_WEIGHT      0.00335f
+#define CUTOFF          0.45f    // of the output sample rate
+#define HIGHPASS        0.996f
+
+
+static const uint8_t length_table[32] =
+{
+	10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+	12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30,
+};
+
+static const uint8_t duty_table[4][8] =
+{
+	{0, 1, 0, 0, 0, 0, 0, 0},
+	{0, 1, 1, 0, 0, 0, 0, 0},
+	{0, 1, 1, 1, 1, 0, 0, 0},
+	{1, 0, 0, 1, 1, 1, 1, 1},
+};
+
+static const uint8_t triangle_table[32] =
+{
+	15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+};
+
+// frame sequencer steps (CPU cycles after a $4017 write), then the 4- and 5-step periods
+static const uint16_t ntsc_steps[7] = {7457, 14913, 22371, 29829, 37281, 29830, 37282};
+static const uint16_t pal_steps[7]  = {8313, 16627, 24939, 33253, 41565, 33254, 41566};
+
+static const uint16_t ntsc_noise[16] = {4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068};
+static const uint16_t pal_noise[16]  = {4, 8, 14, 30, 60, 88, 118, 148, 188, 236, 354, 472, 708, 944, 1890, 3778};
+
+static const uint16_t ntsc_dmc[16] = {428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54};
+static const uint16_t pal_dmc[16]  = {398, 354, 316, 298, 276, 236, 210, 198, 176, 148, 132, 118, 98, 78, 66, 50};
+
+
+// BAND-LIMITED SYNTHESIS
+// Channel outputs are only tracked as steps. Each step adds a windowed-sinc
+// impulse, picked from BLIP_PHASES sub-sample positions, into a buffer of
+// differences which is integrated when samples are read out. The impulse is
+// delayed by half its width, so samples before a step's cycle are final.
+
+static void build_kernel(APU *apu)
+{
+	for (int p = 0; p < BLIP_PHASES; p++)
+	{
+		float sum = 0;
+		for (int k = 0; k < BLIP_TAPS; k++)
+		{
+			float x = k - (BLIP_TAPS / 2 - 1) - (float)p / BLIP_PHASES;
+			float s = x == 0 ? 1 : sinf(M_PI * 2 * CUTOFF * x) / (M_PI * 2 * CUTOFF * x);
+			float w = 0.42f + 0.5f * cosf(M_PI * x / (BLIP_TAPS / 2)) + 0.08f * cosf(2 * M_PI * x / (BLIP_TAPS / 2));
+			apu->kernel[p][k] = s * w;
+			sum += s * w;
+		}
+		for (int k = 0; k < BLIP_TAPS; k++)
+			apu->kernel[p][k] /= sum;
+	}
+}
+
+// Output position of a CPU cycle, in 1/master_hz of a sample
+static uint64_t sample_time(APU *apu, uint64_t cycle)
+{
+	return (cycle - apu->origin) * apu->sample_rate * apu->master_per_cpu;
+}
+
+// four floats, so a step's BLIP_TAPS taps are a few SIMD multiply-adds at -O2
+typedef float f32x4 __attribute__((vector_size(16)));
+
+static void add_delta(APU *apu, uint64_t cycle, float delta)
+{
+	uint64_t time = sample_time(apu, cycle);
+	uint64_t i = time / apu->master_hz - apu->samples_done;
+	uint32_t phase = time % apu->master_hz * BLIP_PHASES / apu->master_hz;
+
+	if (i + BLIP_TAPS > BLIP_SIZE)
+		return;  // more than APU_BUFFER samples behind; dropped
+
+	_Static_assert(BLIP_TAPS % 4 == 0, "the taps are added four at a time");
+	float *kernel = apu->kernel[phase];
+	float *blip = &apu->blip[i];
+	for (int k = 0; k < BLIP_TAPS; k += 4)
+	{
+		f32x4 taps, sum;  // blip isn't aligned to a vector; memcpy compiles to unaligned moves
+		memcpy(&taps, &kernel[k], sizeof(taps));
+		memcpy(&sum, &blip[k], sizeof(sum));
+		sum += taps * delta;
+		memcpy(&blip[k], &sum, sizeof(sum));
+	}
+}
+
+static void set_output(APU *apu, uint8_t *out, uint8_t value, uint64_t cycle, float weight)
+{
+	if (value == *out)
+		return;
+	add_delta(apu, cycle, ((int)value - *out) * weight);
+	*out = value;
+}
+
+
+// CHANNELS
+// Timers only run between events, jumping from one tick to the next; while a
+// channel is silent its timer is skipped ahead in one step.
+
+static uint8_t envelope_volume(Envelope *env, uint8_t reg)
+{
+	return reg & 0x10 ? reg & 0x0F : env->decay;
+}
+
+static uint16_t sweep_target(Pulse *p, int channel)
+{
+	uint16_t change = p->period >> (p->regs[1] & 0x07);
+	if (!(p->regs[1] & 0x08))
+		return p->period + change;
+	// pulse 1 negates with one's complement
+	return p->period - change - (channel == 0 ? 1 : 0);
+}
+
+static uint8_t pulse_audible(Pulse *p, int channel)
+{
+	return p->length && p->period >= 8 && sweep_target(p, channel) <= 0x7FF;
+}
+
+static uint8_t pulse_output(Pulse *p, int channel)
+{
+	if (!pulse_audible(p, channel) || !duty_table[p->regs[0] >> 6][p->seq])
+		return 0;
+	return envelope_volume(&p->env, p->regs[0]);
+}
+
+static void run_pulse(APU *apu, int channel, uint64_t to)
+{
+	Pulse *p = &apu->pulse[channel];
+	uint64_t period = (uint64_t)(p->period + 1) * 2;
+
+	if (p->next > to)
+		return;
+	if (!pulse_audible(p, channel))
+	{
+		uint64_t ticks = (to - p->next) / period + 1;
+		p->seq = (p->seq + ticks) & 0x07;
+		p->next += ticks * period;
+		return;
+	}
+	for (; p->next <= to; p->next += period)
+	{
+		p->seq = (p->seq + 1) & 0x07;
+		set_output(apu, &p->out, pulse_output(p, channel), p->next, PULSE_WEIGHT);
+	}
+}
+
+static uint16_t triangle_period(Triangle *t)
+{
+	return ((t->regs[3] & 0x07) << 8 | t->regs[2]) + 1;
+}
+
+static void run_triangle(APU *apu, uint64_t to)
+{
+	Triangle *t = &apu->triangle;
+	uint64_t period = triangle_period(t);
+
+	if (t->next > to)
+		return;
+	// halted, or ultrasonic: the output holds
+	if (!t->length || !t->linear || period < 3)
+	{
+		t->next += ((to - t->next) / period + 1) * period;
+		return;
+	}
+	for (; t->next <= to; t->next += period)
+	{
+		t->seq = (t->seq + 1) & 0x1F;
+		set_output(apu, &t->out, triangle_table[t->seq], t->next, TRIANGLE_WEIGHT);
+	}
+}
+
+static uint8_t noise_output(Noise *n)
+{
+	if (!n->length || n->shift & 0x01)
+		return 0;
+	return envelope_volume(&n->env, n->regs[0]);
+}
+
+static void run_noise(APU *apu, uint64_t to)
+{
+	Noise *n = &apu->noise;
+	uint64_t period = apu->noise_periods[n->regs[2] & 0x0F];
+	uint8_t tap = n->regs[2] & 0x80 ? 6 : 1;
+
+	if (n->next > to)
+		return;
+	if (!n->length)
+	{
+		n->next += ((to - n->next) / period + 1) * period;
+		return;
+	}
+	for (; n->next <= to; n->next += period)
+	{
+		uint16_t feedback = (n->shift ^ (n->shift >> tap)) & 0x01;
+		n->shift = (n->shift >> 1) | (feedback << 14);
+		set_output(apu, &n->out, noise_output(n), n->next, NOISE_WEIGHT);
+	}
+}
+
+static void dmc_restart(DMC *d)
+{
+	d->addr = 0xC000 | (uint16_t)d->regs[2] << 6;
+	d->remaining = (uint16_t)d->regs[3] << 4 | 1;
+}
+
+// Sample bytes are fetched straight from memory; the CPU isn't stalled
+static void run_dmc(APU *apu, uint64_t to)
+{
+	DMC *d = &apu->dmc;
+	uint64_t period = apu->dmc_rates[d->regs[0] & 0x0F];
+
+	if (d->next > to)
+		return;
+	if (!d->bits && !d->remaining)
+	{
+		d->next += ((to - d->next) / period + 1) * period;
+		return;
+	}
+	for (; d->next <= to; d->next += period)
+	{
+		if (!d->bits)
+		{
+			if (!d->remaining)
+				continue;
+			d->shift = apu->memory[d->addr];
+			d->addr = d->addr == 0xFFFF ? 0x8000 : d->addr + 1;
+			d->bits = 8;
+			if (!--d->remaining)
+			{
+				if (d->regs[0] & 0x40)
+					dmc_restart(d);
+				else if (d->regs[0] & 0x80)
+					d->irq = 1;
+			}
+		}
+
+		if (d->shift & 0x01)
+			d->level += d->level <= 125 ? 2 : 0;
+		else
+			d->level -= d->level >= 2 ? 2 : 0;
+		d->shift >>= 1;
+		d->bits--;
+		set_output(apu, &d->out, d->level, d->next, DMC_WEIGHT);
+	}
+}
+
+// The fetch that empties a sample comes after the bits left in the shifter and
+// 8 timer ticks per byte after that; it raises the IRQ unless the sample loops
+static uint64_t dmc_irq_cycle(APU *apu)
+{
+	DMC *d = &apu->dmc;
+	if (!d->remaining || (d->regs[0] & 0xC0) != 0x80)
+		return UINT64_MAX;
+	uint64_t period = apu->dmc_rates[d->regs[0] & 0x0F];
+	return d->next + ((uint64_t)d->bits + 8 * (uint64_t)(d->remaining - 1)) * period;
+}
+
+static void run_channels(APU *apu, uint64_t to)
+{
+	run_pulse(apu, 0, to);
+	run_pulse(apu, 1, to);
+	run_triangle(apu, to);
+	run_noise(apu, to);
+	run_dmc(apu, to);
+}
+
+// Pick up output changes caused by a write or a frame sequencer step
+static void update_outputs(APU *apu, uint64_t cycle)
+{
+	set_output(apu, &apu->pulse[0].out, pulse_output(&apu->pulse[0], 0), cycle, PULSE_WEIGHT);
+	set_output(apu, &apu->pulse[1].out, pulse_output(&apu->pulse[1], 1), cycle, PULSE_WEIGHT);
+	set_output(apu, &apu->noise.out, noise_output(&apu->noise), cycle, NOISE_WEIGHT);
+	set_output(apu, &apu->dmc.out, apu->dmc.level, cycle, DMC_WEIGHT);
+}
+
+
+// FRAME SEQUENCER
+// details: https://www.nesdev.org/wiki/APU_Frame_Counter
+
+static void clock_envelope(Envelope *env, uint8_t reg)
+{
+	if (env->start)
+	{
+		env->start = 0;
+		env->decay = 15;
+		env->divider = reg & 0x0F;
+	}
+	else if (env->divider)
+		env->divider--;
+	else
+	{
+		env->divider = reg & 0x0F;
+		if (env->decay)
+			env->decay--;
+		else if (reg & 0x20)
+			env->decay = 15;
+	}
+}
+
+static void clock_quarter_frame(APU *apu)
+{
+	Triangle *t = &apu->triangle;
+
+	clock_envelope(&apu->pulse[0].env, apu->pulse[0].regs[0]);
+	clock_envelope(&apu->pulse[1].env, apu->pulse[1].regs[0]);
+	clock_envelope(&apu->noise.env, apu->noise.regs[0]);
+
+	if (t->linear_reload)
+		t->linear = t->regs[0] & 0x7F;
+	else if (t->linear)
+		t->linear--;
+	if (!(t->regs[0] & 0x80))
+		t->linear_reload = 0;
+}
+
+static void clock_half_frame(APU *apu)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		Pulse *p = &apu->pulse[i];
+		uint16_t target = sweep_target(p, i);
+
+		if (p->length && !(p->regs[0] & 0x20))
+			p->length--;
+
+		if (!p->sweep_divider && (p->regs[1] & 0x80) && (p->regs[1] & 0x07) && p->period >= 8 && target <= 0x7FF)
+			p->period = target;
+		if (!p->sweep_divider || p->sweep_reload)
+		{
+			p->sweep_divider = (p->regs[1] >> 4) & 0x07;
+			p->sweep_reload = 0;
+		}
+		else
+			p->sweep_divider--;
+	}
+
+	if (apu->triangle.length && !(apu->triangle.regs[0] & 0x80))
+		apu->triangle.length--;
+	if (apu->noise.length && !(apu->noise.regs[0] & 0x20))
+		apu->noise.length--;
+}
+
+static void clock_sequencer(APU *apu)
+{
+	uint8_t last = apu->five_step ? 4 : 3;
+	uint64_t now = apu->step_cycle;
+
+	if (apu->step != 3 || !apu->five_step)
+		clock_quarter_frame(apu);
+	if (apu->step == 1 || apu->step == last)
+		clock_half_frame(apu);
+	if (apu->step == 3 && !apu->five_step && !apu->irq_inhibit)
+		apu->frame_irq = 1;
+
+	uint64_t origin = now - apu->steps[apu->step];
+	if (apu->step == last)
+	{
+		origin += apu->steps[apu->five_step ? 6 : 5];
+		apu->step = 0;
+	}
+	else
+		apu->step++;
+	apu->step_cycle = origin + apu->steps[apu->step];
+	update_outputs(apu, now);
+}
+
+static void write_frame_counter(APU *apu, uint64_t cycle, uint8_t value)
+{
+	apu->five_step = value & 0x80 ? 1 : 0;
+	apu->irq_inhibit = value & 0x40 ? 1 : 0;
+	if (apu->irq_inhibit)
+		apu->frame_irq = 0;
+
+	apu->step = 0;
+	apu->step_cycle = cycle + apu->steps[0];
+	apu->next_irq = apu->five_step || apu->irq_inhibit ? UINT64_MAX : cycle + apu->steps[3];
+
+	if (apu->five_step)
+	{
+		clock_quarter_frame(apu);
+		clock_half_frame(apu);
+		update_outputs(apu, cycle);
+	}
+}
+
+
+// REGISTERS
+
+void reset_apu(APU *apu, uint8_t *memory, uint64_t master_hz, uint32_t master_per_cpu, uint8_t pal, uint32_t sample_rate)
+{
+	memset(apu, 0, sizeof(APU));
+	apu->memory = memory;
+	apu->master_hz = master_hz;
+	apu->master_per_cpu = master_per_cpu;
+	apu->sample_rate = sample_rate;
+	apu->steps = pal ? pal_steps : ntsc_steps;
+	apu->noise_periods = pal ? pal_noise : ntsc_noise;
+	apu->dmc_rates = pal ? pal_dmc : ntsc_dmc;
+	apu->noise.shift = 1;
+	apu->next_dmc_irq = UINT64_MAX;
+	build_kernel(apu);
+	write_frame_counter(apu, 0, 0);
+}
+
+static void apply_write(APU *apu, uint64_t cycle, uint8_t reg, uint8_t value)
+{
+	if (reg < 0x08)
+	{
+		Pulse *p = &apu->pulse[reg >> 2];
+		p->regs[reg & 0x03] = value;
+		switch (reg & 0x03)
+		{
+			case 1: p->sweep_reload = 1; break;
+			case 2: p->period = (p->period & 0x0700) | value; break;
+			case 3:
+				p->period = (p->period & 0x00FF) | (uint16_t)(value & 0x07) << 8;
+				if (p->enabled)
+					p->length = length_table[value >> 3];
+				p->seq = 0;
+				p->env.start = 1;
+				break;
+		}
+	}
+	else if (reg < 0x0C)
+	{
+		Triangle *t = &apu->triangle;
+		t->regs[reg & 0x03] = value;
+		if ((reg & 0x03) == 3)
+		{
+			if (t->enabled)
+				t->length = length_table[value >> 3];
+			t->linear_reload = 1;
+		}
+	}
+	else if (reg < 0x10)
+	{
+		Noise *n = &apu->noise;
+		n->regs[reg & 0x03] = value;
+		if ((reg & 0x03) == 3)
+		{
+			if (n->enabled)
+				n->length = length_table[value >> 3];
+			n->env.start = 1;
+		}
+	}
+	else if (reg < 0x14)
+	{
+		DMC *d = &apu->dmc;
+		d->regs[reg & 0x03] = value;
+		if (reg == 0x10 && !(value & 0x80))
+			d->irq = 0;
+		else if (reg == 0x11)
+			d->level = value & 0x7F;
+	}
+	else if (reg == 0x15)
+	{
+		apu->pulse[0].enabled = value & 0x01;
+		apu->pulse[1].enabled = value & 0x02;
+		apu->triangle.enabled = value & 0x04;
+		apu->noise.enabled = value & 0x08;
+		if (!apu->pulse[0].enabled)
+			apu->pulse[0].length = 0;
+		if (!apu->pulse[1].enabled)
+			apu->pulse[1].length = 0;
+		if (!apu->triangle.enabled)
+			apu->triangle.length = 0;
+		if (!apu->noise.enabled)
+			apu->noise.length = 0;
+		if (!(value & 0x10))
+			apu->dmc.remaining = 0;
+		else if (!apu->dmc.remaining)
+			dmc_restart(&apu->dmc);
+		apu->dmc.irq = 0;
+	}
+	update_outputs(apu, cycle);
+}
+
+// Writes are only queued. $4017, and $4010 and $4015 for the DMC, are applied
+// straight away since they move the IRQs the CPU is scheduled against.
+void apu_write(APU *apu, uint64_t cycle, uint16_t addr, uint8_t value)
+{
+	uint8_t reg = addr & 0x1F;
+	uint8_t now = reg == 0x10 || reg == 0x15 || reg == 0x17;
+
+	if (now || apu->log_len == APU_LOG_SIZE)
+		apu_run(apu, cycle);
+	if (reg == 0x17)
+	{
+		write_frame_counter(apu, cycle, value);
+		return;
+	}
+	if (now)
+	{
+		apply_write(apu, cycle, reg, value);
+		apu->next_dmc_irq = dmc_irq_cycle(apu);
+		return;
+	}
+
+	apu->log[apu->log_len++] = (ApuWrite){cycle, reg, value};
+}
+
+uint8_t apu_read_status(APU *apu, uint64_t cycle)
+{
+	apu_run(apu, cycle);
+
+	uint8_t status = 0;
+	status |= apu->pulse[0].length ? 0x01 : 0;
+	status |= apu->pulse[1].length ? 0x02 : 0;
+	status |= apu->triangle.length ? 0x04 : 0;
+	status |= apu->noise.length ? 0x08 : 0;
+	status |= apu->dmc.remaining ? 0x10 : 0;
+	status |= apu->frame_irq << 6;
+	status |= apu->dmc.irq << 7;
+
+	apu->frame_irq = 0;
+	return status;
+}
+
+// Called when the CPU reaches next_irq
+void apu_frame_irq(APU *apu, uint64_t cycle)
+{
+	apu_run(apu, cycle);
+	apu->frame_irq = 1;
+	apu->next_irq += apu->steps[5];
+}
+
+// Synthesize everything up to `cycle`, replaying queued writes in order
+void apu_run(APU *apu, uint64_t cycle)
+{
+	size_t i = 0;
+
+	for (;;)
+	{
+		uint64_t next = cycle;
+		int write = i < apu->log_len && apu->log[i].cycle <= next;
+
+		if (write)
+			next = apu->log[i].cycle;
+		if (apu->step_cycle <= next)
+		{
+			run_channels(apu, apu->step_cycle);
+			clock_sequencer(apu);
+			continue;
+		}
+
+		run_channels(apu, next);
+		if (!write)
+			break;
+		apply_write(apu, next, apu->log[i].reg, apu->log[i].value);
+		i++;
+	}
+
+	apu->log_len = 0;
+	apu->cycle = cycle;
+	apu->next_dmc_irq = dmc_irq_cycle(apu);
+}
+
+// Finish the slice and read out every sample before `cycle`
+void apu_end_frame(APU *apu, uint64_t cycle)
+{
+	apu_run(apu, cycle);
+
+	uint64_t end = sample_time(apu, cycle) / apu->master_hz;
+	size_t count = end - apu->samples_done;
+	if (count > APU_BUFFER - apu->sample_count)
+		count = APU_BUFFER - apu->sample_count;
+
+	int16_t *out = &apu->samples[apu->sample_count];
+	float acc = apu->integrator, hp_in = apu->hp_in, hp_out = apu->hp_out;
+	for (size_t i = 0; i < count; i++)
+	{
+		acc += apu->blip[i];
+		hp_out = acc - hp_in + HIGHPASS * hp_out;
+		hp_in = acc;
+
+		float s = hp_out * 32767.0f;
+		out[i] = s > 32767.0f ? 32767 : s < -32768.0f ? -32768 : (int16_t)s;
+	}
+	apu->integrator = acc;
+	apu->hp_in = hp_in;
+	apu->hp_out = hp_out;
+
+	memmove(apu->blip, apu->blip + count, (BLIP_SIZE - count) * sizeof(float));
+	memset(apu->blip + BLIP_SIZE - count, 0, count * sizeof(float));
+	apu->sample_count += count;
+	apu->samples_done = end;
+
+	// move the origin forward by a whole number of samples so sample_time
+	// stays exact and can't overflow
+	uint64_t a = apu->master_hz, b = (uint64_t)apu->sample_rate * apu->master_per_cpu;
+	while (b)
+	{
+		uint64_t r = a % b;
+		a = b;
+		b = r;
+	}
+	uint64_t period = apu->master_hz / a;
+	uint64_t period_samples = period * apu->sample_rate * apu->master_per_cpu / apu->master_hz;
+	while (cycle - apu->origin >= 2 * period && apu->samples_done >= period_samples)
+	{
+		apu->origin += period;
+		apu->samples_done -= period_samples;
+	}
+}
+
+
+// WAV OUTPUT
+// 16-bit mono PCM; sizes are filled in on close
+
+static void put_le(uint8_t *p, uint32_t value, int bytes)
+{
+	for (int i = 0; i < bytes; i++)
+		p[i] = value >> (8 * i);
+}
+
+FILE *wav_open(char *file_name, uint32_t sample_rate)
+{
+	uint8_t header[44] = "RIFF\0\0\0\0WAVEfmt ";
+	FILE *f = fopen(file_name, "wb");
+	if (f == NULL)
+	{
+		perror("fopen");
+		return NULL;
+	}
+
+	put_le(header + 16, 16, 4);               // fmt chunk size
+	put_le(header + 20, 1, 2);                // PCM
+	put_le(header + 22, 1, 2);                // mono
+	put_le(header + 24, sample_rate, 4);
+	put_le(header + 28, sample_rate * 2, 4);  // bytes per second
+	put_le(header + 32, 2, 2);                // block align
+	put_le(header + 34, 16, 2);               // bits per sample
+	memcpy(header + 36, "data", 4);
+	put_le(header + 4, 0xFFFFFFFF, 4);        // sizes unknown until wav_close, and
+	put_le(header + 40, 0xFFFFFFFF, 4);       // for good when streaming to a pipe
+	fwrite(header, 1, sizeof(header), f);
+	return f;
+}
+
+void wav_write(FILE *f, int16_t *samples, size_t count)
+{
+	uint8_t buffer[2 * APU_BUFFER];
+	while (count)
+	{
+		size_t n = count < APU_BUFFER ? count : APU_BUFFER;
+		for (size_t i = 0; i < n; i++)
+			put_le(buffer + 2 * i, (uint16_t)samples[i], 2);
+		fwrite(buffer, 2, n, f);
+		samples += n;
+		count -= n;
+	}
+}
+
+// Fills in the sizes, unless the output is a pipe or anything else that can't seek
+void wav_close(FILE *f)
+{
+	uint8_t size[4];
+	long len = ftell(f);
+
+	if (len >= 44 && fseek(f, 4, SEEK_SET) == 0)
+	{
+		put_le(size, len - 8, 4);
+		fwrite(size, 1, 4, f);
+		put_le(size, len - 44, 4);
+		if (fseek(f, 40, SEEK_SET) == 0)
+			fwrite(size, 1, 4, f);
+	}
+	fclose(f);
+}
@@ -0,0 +1,141 @@
+#ifndef _APU_H
+#define _APU_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define APU_LOG_SIZE   1024
+#define APU_BUFFER     4096   // output samples held between drains
+#define BLIP_TAPS      16
+#define BLIP_PHASES    32
+#define BLIP_SIZE      (APU_BUFFER + BLIP_TAPS)
+
+
+typedef struct ApuWrite
+{
+	uint64_t cycle;
+	uint8_t  reg;     // address & 0x1F
+	uint8_t  value;
+} ApuWrite;
+
+typedef struct Envelope
+{
+	uint8_t start;
+	uint8_t divider;
+	uint8_t decay;
+} Envelope;
+
+typedef struct Pulse
+{
+	uint8_t  regs[4];
+	uint8_t  enabled;
+	uint8_t  length;
+	uint8_t  seq;
+	uint8_t  sweep_reload;
+	uint8_t  sweep_divider;
+	uint16_t period;
+	Envelope env;
+	uint64_t next;    // cycle of the next timer tick
+	uint8_t  out;
+} Pulse;
+
+typedef struct Triangle
+{
+	uint8_t  regs[4];
+	uint8_t  enabled;
+	uint8_t  length;
+	uint8_t  linear;
+	uint8_t  linear_reload;
+	uint8_t  seq;
+	uint64_t next;
+	uint8_t  out;
+} Triangle;
+
+typedef struct Noise
+{
+	uint8_t  regs[4];
+	uint8_t  enabled;
+	uint8_t  length;
+	uint16_t shift;
+	Envelope env;
+	uint64_t next;
+	uint8_t  out;
+} Noise;
+
+typedef struct DMC
+{
+	uint8_t  regs[4];
+	uint8_t  level;
+	uint16_t addr;
+	uint16_t remaining;   // sample bytes left
+	uint8_t  shift;
+	uint8_t  bits;
+	uint8_t  irq;
+	uint64_t next;
+	uint8_t  out;
+} DMC;
+
+
+// 2A03 audio: register writes are stamped and queued while the CPU runs, then
+// a whole slice is synthesized at once into a band-limited step buffer
+// details: https://www.nesdev.org/wiki/APU
+typedef struct APU
+{
+	Pulse    pulse[2];
+	Triangle triangle;
+	Noise    noise;
+	DMC      dmc;
+	uint8_t  *memory;       // CPU address space, for DMC sample fetches
+
+	// frame counter ($4017)
+	uint8_t  five_step;
+	uint8_t  irq_inhibit;
+	uint8_t  frame_irq;
+	uint8_t  step;
+	uint64_t step_cycle;    // cycle of the next sequencer step
+	uint64_t next_irq;      // cycle of the next frame IRQ (UINT64_MAX = none)
+	uint64_t next_dmc_irq;  // cycle the current DMC sample ends with an IRQ (UINT64_MAX = none)
+	const uint16_t *steps;
+	const uint16_t *noise_periods;
+	const uint16_t *dmc_rates;
+
+	// write log for the current slice
+	ApuWrite log[APU_LOG_SIZE];
+	size_t   log_len;
+	uint64_t cycle;         // synthesized up to here
+
+	// band-limited synthesis, timed exactly against the master clock
+	uint64_t master_hz;
+	uint32_t master_per_cpu;
+	uint32_t sample_rate;
+	uint64_t origin;        // cycle at sample 0
+	uint64_t samples_done;  // whole samples read out of blip
+	float    level;         // current mixed output
+	float    integrator;
+	float    hp_in, hp_out; // DC-blocking filter state
+	float    kernel[BLIP_PHASES][BLIP_TAPS];
+	float    blip[BLIP_SIZE];
+
+	int16_t  samples[APU_BUFFER];
+	size_t   sample_count;
+} APU;
+
+void reset_apu(APU *, uint8_t *, uint64_t, uint32_t, uint8_t, uint32_t);
+void apu_write(APU *, uint64_t, uint16_t, uint8_t);
+uint8_t apu_read_status(APU *, uint64_t);
+void apu_frame_irq(APU *, uint64_t);
+void apu_run(APU *, uint64_t);
+
+// the sooner of the frame and DMC IRQs
+static inline uint64_t apu_next_irq(APU *apu)
+{
+	return apu->next_irq < apu->next_dmc_irq ? apu->next_irq : apu->next_dmc_irq;
+}
+void apu_end_frame(APU *, uint64_t);
+
+FILE *wav_open(char *, uint32_t);
+void wav_write(FILE *, int16_t *, size_t);
+void wav_close(FILE *);
+
+#endif
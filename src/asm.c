@@ -0,0 +1,686 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "asm.h"
+
+// Two-pass 6502 assembler writing straight into a CPU's memory. Opcodes come
+// from instruction_table, matched on mnemonic and addressing mode function.
+//
+//   ; comment
+//   label:  LDA #<table        ; < and > take the low and high byte
+//   count = $10                ; constants; *= $8000 or .org sets the address
+//           STA (ptr),Y
+//           BNE label
+//   table:  .byte 1, 2, "text" ; also .word and .res count[, fill]
+//
+// Expressions: $hex, %binary, decimal, 'c', labels, * (this address), unary
+// - ~ < >, and * / % + - << >> & ^ | with C precedence, with parentheses.
+// A label used before its definition is always addressed as absolute, so
+// both passes agree on every instruction's size.
+
+
+static void fail(Assembler *as, const char *format, ...)
+{
+	if (as->error[0])
+		return;
+
+	int n = snprintf(as->error, ASM_ERROR, "line %d: ", as->line);
+	va_list args;
+	va_start(args, format);
+	vsnprintf(as->error + n, ASM_ERROR - n, format, args);
+	va_end(args);
+}
+
+static void skip_space(const char **p)
+{
+	while (**p == ' ' || **p == '\t' || **p == '\r')
+		(*p)++;
+}
+
+static int is_name_start(char c)
+{
+	return isalpha((unsigned char)c) || c == '_' || c == '.';
+}
+
+static int is_name_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+// Copies a name into buffer; 0 if there isn't one here
+static int read_name(const char **p, char *buffer)
+{
+	if (!is_name_start(**p))
+		return 0;
+
+	size_t len = 0;
+	while (is_name_char(**p))
+	{
+		if (len < ASM_NAME - 1)
+			buffer[len++] = **p;
+		(*p)++;
+	}
+	buffer[len] = '\0';
+	return 1;
+}
+
+
+// LABELS
+
+static AsmLabel *find_label(Assembler *as, const char *name)
+{
+	for (size_t i = 0; i < as->label_count; i++)
+		if (strcmp(as->labels[i].name, name) == 0)
+			return &as->labels[i];
+	return NULL;
+}
+
+static void define_label(Assembler *as, const char *name, uint16_t value, uint8_t unknown)
+{
+	AsmLabel *label = find_label(as, name);
+
+	if (as->pass == 1)
+	{
+		if (label)
+		{
+			fail(as, "%s is already defined", name);
+			return;
+		}
+		if (as->label_count == ASM_LABELS)
+		{
+			fail(as, "more than %d labels", ASM_LABELS);
+			return;
+		}
+		label = &as->labels[as->label_count++];
+		snprintf(label->name, ASM_NAME, "%s", name);
+		label->line = as->line;
+		label->unknown = unknown;
+	}
+	else if (label->value != value && !label->unknown)
+	{
+		fail(as, "%s moved from $%04X to $%04X between passes", name, label->value, value);
+		return;
+	}
+	label->value = value;
+}
+
+// Value of a label, or -1 if it isn't defined
+long asm_label(Assembler *as, const char *name)
+{
+	AsmLabel *label = find_label(as, name);
+	return label ? label->value : -1;
+}
+
+
+// EXPRESSIONS
+// Recursive descent, one function per precedence level
+
+static long expression(Assembler *as, const char **p);
+
+static long number(Assembler *as, const char **p, int base)
+{
+	char *end;
+	long value = strtol(*p, &end, base);
+	if (end == *p)
+		fail(as, "bad number");
+	*p = end;
+	return value;
+}
+
+static long primary(Assembler *as, const char **p)
+{
+	char name[ASM_NAME];
+	skip_space(p);
+
+	switch (**p)
+	{
+		case '$':
+			(*p)++;
+			return number(as, p, 16);
+		case '%':
+			(*p)++;
+			return number(as, p, 2);
+		case '*':
+			(*p)++;
+			return as->pc;
+		case '\'':
+		{
+			long value = (unsigned char)(*p)[1];
+			if (!value || (*p)[2] != '\'')
+				fail(as, "bad character constant");
+			else
+				*p += 3;
+			return value;
+		}
+		case '(':
+		{
+			(*p)++;
+			long value = expression(as, p);
+			skip_space(p);
+			if (**p != ')')
+				fail(as, "missing )");
+			else
+				(*p)++;
+			return value;
+		}
+	}
+
+	if (isdigit((unsigned char)**p))
+		return number(as, p, 10);
+	if (!read_name(p, name))
+	{
+		fail(as, "expected a value");
+		return 0;
+	}
+
+	AsmLabel *label = find_label(as, name);
+	if (label == NULL)
+	{
+		if (as->pass == 2)
+			fail(as, "%s is not defined", name);
+		as->forward = 1;
+		return 0;
+	}
+	if (label->line > as->line || label->unknown)
+		as->forward = 1;
+	return label->value;
+}
+
+static long unary(Assembler *as, const char **p)
+{
+	skip_space(p);
+	switch (**p)
+	{
+		case '-': (*p)++; return -unary(as, p);
+		case '~': (*p)++; return ~unary(as, p) & 0xFFFF;
+		case '<': (*p)++; return unary(as, p) & 0xFF;
+		case '>': (*p)++; return (unary(as, p) >> 8) & 0xFF;
+	}
+	return primary(as, p);
+}
+
+static long product(Assembler *as, const char **p)
+{
+	long value = unary(as, p);
+	for (;;)
+	{
+		skip_space(p);
+		char op = **p;
+		if (op != '*' && op != '/' && op != '%')
+			return value;
+		(*p)++;
+
+		long right = unary(as, p);
+		if (op == '*')
+			value *= right;
+		else if (right == 0)
+			fail(as, "division by zero");
+		else
+			value = op == '/' ? value / right : value % right;
+	}
+}
+
+static long sum(Assembler *as, const char **p)
+{
+	long value = product(as, p);
+	for (;;)
+	{
+		skip_space(p);
+		if (**p == '+')
+		{
+			(*p)++;
+			value += product(as, p);
+		}
+		else if (**p == '-')
+		{
+			(*p)++;
+			value -= product(as, p);
+		}
+		else
+			return value;
+	}
+}
+
+static long shift(Assembler *as, const char **p)
+{
+	long value = sum(as, p);
+	for (;;)
+	{
+		skip_space(p);
+		if ((*p)[0] == '<' && (*p)[1] == '<')
+		{
+			*p += 2;
+			value <<= sum(as, p) & 31;
+		}
+		else if ((*p)[0] == '>' && (*p)[1] == '>')
+		{
+			*p += 2;
+			value >>= sum(as, p) & 31;
+		}
+		else
+			return value;
+	}
+}
+
+static long bitwise(Assembler *as, const char **p, char op)
+{
+	long value = op == '&' ? shift(as, p) : bitwise(as, p, op == '|' ? '^' : '&');
+	for (;;)
+	{
+		skip_space(p);
+		if (**p != op)
+			return value;
+		(*p)++;
+
+		if (op == '&')
+			value &= shift(as, p);
+		else if (op == '^')
+			value ^= bitwise(as, p, '&');
+		else
+			value |= bitwise(as, p, '^');
+	}
+}
+
+static long expression(Assembler *as, const char **p)
+{
+	return bitwise(as, p, '|');
+}
+
+
+// OUTPUT
+// Only the second pass stores; the first just counts
+
+static void emit(Assembler *as, uint8_t value)
+{
+	if (as->pass == 2)
+	{
+		CPU *cpu = as->cpu;
+		cpu->memory[as->pc] = value;
+		cpu->dirty[as->pc >> 8] = 0xFF;
+		if (cpu->code_page[as->pc >> 8])
+			invalidate_code(cpu, as->pc, as->pc);
+
+		if (!as->bytes || as->pc < as->first)
+			as->first = as->pc;
+		if (!as->bytes || as->pc > as->last)
+			as->last = as->pc;
+		as->bytes++;
+	}
+	as->pc++;
+}
+
+static void emit_byte(Assembler *as, long value)
+{
+	if (as->pass == 2 && (value < -128 || value > 255))
+		fail(as, "$%lX doesn't fit in a byte", value);
+	emit(as, value & 0xFF);
+}
+
+static void emit_word(Assembler *as, long value)
+{
+	emit(as, value & 0xFF);
+	emit(as, (value >> 8) & 0xFF);
+}
+
+
+// INSTRUCTIONS
+
+// instruction_table's opcodes grouped by mnemonic, indexed by its three
+// letters; built on first use. "XXX", the unofficial opcodes, is left out.
+typedef struct Mnemonic
+{
+	uint8_t count;
+	uint8_t opcodes[8];  // no mnemonic has more than 8 modes
+} Mnemonic;
+
+static Mnemonic mnemonics[64];
+static uint8_t  mnemonic_index[26 * 26 * 26];  // 1 + position in mnemonics, or 0
+
+static int letters(const char *name)
+{
+	int index = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		int c = toupper((unsigned char)name[i]) - 'A';
+		if (c < 0 || c >= 26)
+			return -1;
+		index = index * 26 + c;
+	}
+	return name[3] ? -1 : index;
+}
+
+static void index_mnemonics(void)
+{
+	size_t count = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		char name[4] = {instruction_table[i].name[0], instruction_table[i].name[1], instruction_table[i].name[2], '\0'};
+		int index = letters(name);
+		if (strcmp(name, "XXX") == 0 || index < 0)
+			continue;
+
+		if (!mnemonic_index[index])
+			mnemonic_index[index] = ++count;
+		Mnemonic *m = &mnemonics[mnemonic_index[index] - 1];
+		m->opcodes[m->count++] = i;
+	}
+}
+
+static Mnemonic *find_mnemonic(const char *name)
+{
+	int index = letters(name);
+	return index >= 0 && mnemonic_index[index] ? &mnemonics[mnemonic_index[index] - 1] : NULL;
+}
+
+static int find_opcode(Mnemonic *m, uint16_t (*mode)(CPU *))
+{
+	for (int i = 0; i < m->count; i++)
+		if (instruction_table[m->opcodes[i]].addr_mode == mode)
+			return m->opcodes[i];
+	return -1;
+}
+
+// ",X" or ",Y" after an operand, or 0
+static char index_register(const char **p)
+{
+	const char *q = *p;
+	skip_space(&q);
+	if (*q != ',')
+		return 0;
+	q++;
+	skip_space(&q);
+
+	char reg = toupper((unsigned char)*q);
+	if ((reg != 'X' && reg != 'Y') || is_name_char(q[1]))
+		return 0;
+	*p = q + 1;
+	return reg;
+}
+
+static int at_end(const char *p)
+{
+	return *p == ';' || *p == '\n' || *p == '\0';
+}
+
+static void instruction(Assembler *as, const char *name, const char **p)
+{
+	Mnemonic *m = find_mnemonic(name);
+	if (m == NULL)
+	{
+		fail(as, "unknown instruction %s", name);
+		return;
+	}
+
+	skip_space(p);
+	int opcode;
+
+	if (at_end(*p))
+	{
+		if ((opcode = find_opcode(m, accumulator)) < 0 && (opcode = find_opcode(m, implied)) < 0)
+			fail(as, "%s needs an operand", name);
+		else
+			emit(as, opcode);
+		return;
+	}
+	if (toupper((unsigned char)**p) == 'A' && !is_name_char((*p)[1]) && (opcode = find_opcode(m, accumulator)) >= 0)
+	{
+		(*p)++;
+		emit(as, opcode);
+		return;
+	}
+
+	if (**p == '#')
+	{
+		(*p)++;
+		long value = expression(as, p);
+		if ((opcode = find_opcode(m, immediate)) < 0)
+		{
+			fail(as, "%s has no immediate mode", name);
+			return;
+		}
+		emit(as, opcode);
+		emit_byte(as, value);
+		return;
+	}
+
+	// (zp,X), (zp),Y and (abs); anything else in parentheses is an expression
+	if (**p == '(')
+	{
+		const char *q = *p + 1;
+		long value = expression(as, &q);
+		skip_space(&q);
+
+		uint16_t (*mode)(CPU *) = NULL;
+		if (index_register(&q) == 'X')
+		{
+			skip_space(&q);
+			if (*q == ')')
+			{
+				q++;
+				mode = zero_indirect_x;
+			}
+		}
+		else if (*q == ')')
+		{
+			q++;
+			if (index_register(&q) == 'Y')
+				mode = zero_indirect_y;
+			else
+			{
+				const char *end = q;
+				skip_space(&end);
+				if (at_end(end) && find_opcode(m, indirect) >= 0)
+					mode = indirect;
+			}
+		}
+
+		if (mode)
+		{
+			if ((opcode = find_opcode(m, mode)) < 0)
+			{
+				fail(as, "%s has no indirect mode", name);
+				return;
+			}
+			emit(as, opcode);
+			if (mode == indirect)
+				emit_word(as, value);
+			else
+				emit_byte(as, value);
+			*p = q;
+			return;
+		}
+	}
+
+	as->forward = 0;
+	long value = expression(as, p);
+	uint8_t fits = !as->forward && value >= 0 && value <= 0xFF;
+	char reg = index_register(p);
+
+	if (reg == 0 && (opcode = find_opcode(m, relative)) >= 0)
+	{
+		long offset = value - (as->pc + 2);
+		if (as->pass == 2 && (offset < -128 || offset > 127))
+			fail(as, "branch to $%04lX is out of range", value & 0xFFFF);
+		emit(as, opcode);
+		emit(as, offset & 0xFF);
+		return;
+	}
+
+	uint16_t (*zero)(CPU *) = reg == 'X' ? zero_offset_x : reg == 'Y' ? zero_offset_y : zero_page;
+	uint16_t (*full)(CPU *) = reg == 'X' ? abs_offset_x : reg == 'Y' ? abs_offset_y : absolute;
+	int zero_opcode = find_opcode(m, zero), full_opcode = find_opcode(m, full);
+
+	if (zero_opcode >= 0 && (fits || full_opcode < 0))
+	{
+		emit(as, zero_opcode);
+		emit_byte(as, value);
+	}
+	else if (full_opcode >= 0)
+	{
+		emit(as, full_opcode);
+		emit_word(as, value);
+	}
+	else
+		fail(as, "%s has no such addressing mode", name);
+}
+
+
+// DIRECTIVES
+
+static void directive(Assembler *as, const char *name, const char **p)
+{
+	if (strcasecmp(name, ".org") == 0)
+	{
+		as->pc = expression(as, p);
+		return;
+	}
+	if (strcasecmp(name, ".res") == 0 || strcasecmp(name, ".ds") == 0)
+	{
+		long count = expression(as, p), fill = 0;
+		skip_space(p);
+		if (**p == ',')
+		{
+			(*p)++;
+			fill = expression(as, p);
+		}
+		if (count < 0 || count > ADDRESS_BYTES)
+			fail(as, "bad .res size %ld", count);
+		for (long i = 0; i < count && !as->error[0]; i++)
+			emit_byte(as, fill);
+		return;
+	}
+
+	int word = strcasecmp(name, ".word") == 0 || strcasecmp(name, ".dw") == 0;
+	if (!word && strcasecmp(name, ".byte") != 0 && strcasecmp(name, ".db") != 0)
+	{
+		fail(as, "unknown directive %s", name);
+		return;
+	}
+
+	// comma-separated values; .byte also takes "strings"
+	for (;;)
+	{
+		skip_space(p);
+		if (**p == '"' && !word)
+		{
+			for ((*p)++; **p && **p != '"' && **p != '\n'; (*p)++)
+				emit(as, **p);
+			if (**p != '"')
+				fail(as, "unterminated string");
+			else
+				(*p)++;
+		}
+		else if (word)
+			emit_word(as, expression(as, p));
+		else
+			emit_byte(as, expression(as, p));
+
+		skip_space(p);
+		if (**p != ',' || as->error[0])
+			return;
+		(*p)++;
+	}
+}
+
+
+// One line: [label:] [instruction | directive | name = value | *= value] [; comment]
+static void line(Assembler *as, const char **p)
+{
+	char name[ASM_NAME];
+
+	skip_space(p);
+	if (**p == '*')
+	{
+		(*p)++;
+		skip_space(p);
+		if (**p != '=')
+		{
+			fail(as, "expected *=");
+			return;
+		}
+		(*p)++;
+		as->pc = expression(as, p);
+	}
+	else if (read_name(p, name))
+	{
+		skip_space(p);
+		if (**p == ':' || **p == '=')
+		{
+			uint8_t constant = **p == '=';
+			(*p)++;
+			if (constant)
+			{
+				as->forward = 0;
+				long value = expression(as, p);
+				define_label(as, name, value & 0xFFFF, as->forward);
+				goto end;
+			}
+			else
+			{
+				define_label(as, name, as->pc, 0);
+				skip_space(p);
+				if (!read_name(p, name))
+					goto end;
+			}
+		}
+
+		if (name[0] == '.')
+			directive(as, name, p);
+		else
+			instruction(as, name, p);
+	}
+
+end:
+	skip_space(p);
+	if (**p == ';')
+		while (**p && **p != '\n')
+			(*p)++;
+	if (**p && **p != '\n')
+	{
+		int len = 0;
+		while (len < 10 && (*p)[len] && (*p)[len] != '\n')
+			len++;
+		fail(as, "unexpected \"%.*s\"", len, *p);
+	}
+}
+
+// Assemble source into the CPU's memory, starting at origin unless it says
+// otherwise. Returns 0, or -1 with the reason in as->error. Stores go straight
+// to memory, not through I/O handlers, and invalidate decoded code under them.
+int assemble(Assembler *as, CPU *cpu, const char *source, uint16_t origin)
+{
+	if (!mnemonic_index[letters("LDA")])
+		index_mnemonics();
+
+	as->cpu = cpu;
+	as->label_count = 0;
+	as->first = as->last = 0;
+	as->bytes = 0;
+	as->error[0] = '\0';
+
+	for (as->pass = 1; as->pass <= 2; as->pass++)
+	{
+		const char *p = source;
+		as->pc = origin;
+		as->line = 1;
+
+		while (*p && !as->error[0])
+		{
+			line(as, &p);
+			while (*p && *p != '\n' && !as->error[0])
+				p++;
+			if (*p == '\n')
+			{
+				p++;
+				as->line++;
+			}
+		}
+		if (as->error[0])
+			return -1;
+	}
+	return 0;
+}
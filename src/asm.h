@@ -0,0 +1,40 @@
+#ifndef _ASM_H
+#define _ASM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu.h"
+
+#define ASM_LABELS  512
+#define ASM_NAME    32
+#define ASM_ERROR   128
+
+
+typedef struct AsmLabel
+{
+	char     name[ASM_NAME];
+	uint16_t value;
+	int      line;       // where it was defined
+	uint8_t  unknown;    // defined from a forward reference, so never zero page
+} AsmLabel;
+
+// Two-pass assembler state. After assemble() the labels can be looked up and
+// [first, last] is the range written; on failure error holds "line N: ...".
+typedef struct Assembler
+{
+	CPU     *cpu;
+	AsmLabel labels[ASM_LABELS];
+	size_t   label_count;
+	int      pass;
+	int      line;
+	uint16_t pc;
+	uint8_t  forward;    // the last expression used a label defined later
+	uint16_t first, last;
+	size_t   bytes;
+	char     error[ASM_ERROR];
+} Assembler;
+
+int assemble(Assembler *, CPU *, const char *, uint16_t);
+long asm_label(Assembler *, const char *);
+
+#endif
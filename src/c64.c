@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "c64.h"
+
+#define BASIC_START    0xA0
+#define IO_START       0xD0
+#define KERNAL_START   0xE0
+
+
+// Which of RAM, a ROM or the I/O area each page reads from under a configuration
+static void build_map(C64 *c64, uint8_t config)
+{
+	uint8_t **map = c64->maps[config];
+
+	for (size_t page = 0; page < PAGES; page++)
+		map[page] = &c64->cpu->memory[page * BYTES_PER_PAGE];
+
+	if ((config & (LORAM | HIRAM)) == (LORAM | HIRAM))
+		for (size_t page = 0; page < BASIC_SIZE / BYTES_PER_PAGE; page++)
+			map[BASIC_START + page] = &c64->basic[page * BYTES_PER_PAGE];
+
+	if (config & HIRAM)
+		for (size_t page = 0; page < KERNAL_SIZE / BYTES_PER_PAGE; page++)
+			map[KERNAL_START + page] = &c64->kernal[page * BYTES_PER_PAGE];
+
+	// all RAM only with both LORAM and HIRAM low; else CHAREN picks I/O or characters
+	if (config & (LORAM | HIRAM))
+		for (size_t page = 0; page < IO_SIZE / BYTES_PER_PAGE; page++)
+			map[IO_START + page] = config & CHAREN ? &c64->io[page * BYTES_PER_PAGE]
+			                                       : &c64->chargen[page * BYTES_PER_PAGE];
+}
+
+// Reads of the I/O area go straight through the page table like ROM; only
+// stores need diverting away from RAM
+static void io_write(void *data, uint16_t addr, uint8_t value)
+{
+	C64 *c64 = data;
+	c64->io[addr - IO_START * BYTES_PER_PAGE] = value;
+}
+
+static void port_changed(void *owner, uint8_t pins)
+{
+	C64 *c64 = owner;
+	uint8_t config = pins & (LORAM | HIRAM | CHAREN);
+	if (config == c64->config)
+		return;
+
+	map_reads(c64->cpu, c64->maps[config]);
+	WriteHandler write = c64->maps[config][IO_START] == c64->io ? io_write : NULL;
+	if (c64->cpu->io_write[IO_START] != write)
+		map_io(c64->cpu, IO_START, IO_START + IO_SIZE / BYTES_PER_PAGE - 1, NULL, write, c64);
+	c64->config = config;
+	c64->flips++;
+}
+
+static void reset_vector(C64 *c64)
+{
+	CPU *cpu = c64->cpu;
+	cpu->reg.PC = (uint16_t)peek(cpu, 0xFFFD) << 8 | peek(cpu, 0xFFFC);
+}
+
+
+// Powers on with the port's pins all inputs: BASIC, KERNAL and I/O visible
+C64 *init_c64(void)
+{
+	C64 *c64 = calloc(1, sizeof(C64));
+	c64->cpu = init_cpu();
+
+	for (uint8_t config = 0; config < C64_CONFIGS; config++)
+		build_map(c64, config);
+	c64->config = C64_CONFIGS;  // none yet, so the first port update maps one
+	map_port(c64->cpu, port_changed, c64);
+	c64->flips = 0;
+
+	reset_vector(c64);
+	return c64;
+}
+
+void delete_c64(C64 *c64)
+{
+	delete_cpu(c64->cpu);
+	free(c64);
+}
+
+static void load_rom(uint8_t *rom, size_t size, char *file_name)
+{
+	size_t file_len;
+	uint8_t *bytes = read_file_as_bytes(file_name, &file_len);
+
+	if (file_len != size)
+	{
+		fprintf(stderr, "[ERROR] %s should be %lu bytes, not %lu; exiting...",
+		        file_name, (unsigned long)size, (unsigned long)file_len);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(rom, bytes, size);
+	free(bytes);
+}
+
+// Dumps of the three ROMs (e.g. VICE's basic, kernal and chargen), then reset
+void load_c64_roms(C64 *c64, char *basic, char *kernal, char *chargen)
+{
+	load_rom(c64->basic, BASIC_SIZE, basic);
+	load_rom(c64->kernal, KERNAL_SIZE, kernal);
+	load_rom(c64->chargen, CHARGEN_SIZE, chargen);
+	reset_vector(c64);
+}
@@ -0,0 +1,43 @@
+#ifndef _C64_H
+#define _C64_H
+
+#include <stdint.h>
+#include "cpu.h"
+
+#define BASIC_SIZE    0x2000
+#define KERNAL_SIZE   0x2000
+#define CHARGEN_SIZE  0x1000
+#define IO_SIZE       0x1000
+
+// the 6510 port's banking lines ($01 bits 0-2)
+#define LORAM         0x01
+#define HIRAM         0x02
+#define CHAREN        0x04
+#define C64_CONFIGS   8
+
+
+// Commodore 64 memory map: 64 KiB of RAM with BASIC, KERNAL and character
+// ROM or the I/O area banked over it by the 6510's port. Every configuration's
+// page table is built up front, so a store to $01 only swaps which one the CPU
+// reads through. Stores always land in RAM, under a ROM or not, except in the
+// I/O area. The chips behind $D000-$DFFF (VIC-II, SID, CIAs) aren't emulated;
+// their registers read back what was last written.
+// https://www.c64-wiki.com/wiki/Bank_Switching
+typedef struct C64
+{
+	CPU *cpu;
+	uint8_t basic[BASIC_SIZE];
+	uint8_t kernal[KERNAL_SIZE];
+	uint8_t chargen[CHARGEN_SIZE];
+	uint8_t io[IO_SIZE];
+
+	uint8_t *maps[C64_CONFIGS][PAGES];  // read pointer per page, per LORAM/HIRAM/CHAREN
+	uint8_t  config;                    // the one in use
+	uint64_t flips;                     // stores to the port that changed it
+} C64;
+
+C64 *init_c64(void);
+void delete_c64(C64 *);
+void load_c64_roms(C64 *, char *, char *, char *);
+
+#endif
@@ -1,8 +1,11 @@
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include "cpu.h"
+#include "trace.h"
+#include "perf.h"
 
 #define STACK_START    0x0100
 #define STACK_END      0x01FF
@@ -15,36 +18,35 @@
 #define IRQ_HI         0xFFFF
 #define N_INSTRUCTIONS 256
 #define CPU_CLK_START  7
+#define IDLE_MAX_BODY  32
 
 
-FILE *assembly_outfile;
-
 // full instr set: https://www.masswerk.at/6502/6502_instruction_set.html
 // credit to OneLoneCoder for the idea behind this instruction set representation
 Instruction instruction_table[N_INSTRUCTIONS] = 
-{// -0                          -1                                -2                          -3                      -4                              -5                              -6                              -7                      -8                        -9                             -A                            -B                      -C                             -D                             -E                             -F
-	{"BRK", BRK, implied, 7},   {"ORA", ORA, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"ORA", ORA, zero_page, 3},     {"ASL", ASL, zero_page, 5},     {"XXX", NULL, NULL, 2}, {"PHP", PHP, implied, 3}, {"ORA", ORA, immediate, 2},    {"ASL", ASL, accumulator, 2}, {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"ORA", ORA, absolute, 4},     {"ASL", ASL, absolute, 6},     {"XXX", NULL, NULL, 2}, // 2-
-	{"BPL", BPL, relative, 2},  {"ORA", ORA, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"ORA", ORA, zero_offset_x, 4}, {"ASL", ASL, zero_offset_x, 6}, {"XXX", NULL, NULL, 2}, {"CLC", CLC, implied, 2}, {"ORA", ORA, abs_offset_y, 4}, {"XXX", NULL, NULL, 2},       {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"ORA", ORA, abs_offset_x, 4}, {"ASL", ASL, abs_offset_x, 7}, {"XXX", NULL, NULL, 2}, // 1-
-	{"JSR", JSR, absolute, 6},  {"AND", AND, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"BIT", BIT, zero_page, 3},     {"AND", AND, zero_page, 3},     {"ROL", ROL, zero_page, 5},     {"XXX", NULL, NULL, 2}, {"PLP", PLP, implied, 4}, {"AND", AND, immediate, 2},    {"ROL", ROL, accumulator, 2}, {"XXX", NULL, NULL, 2}, {"BIT", BIT, absolute, 4},     {"AND", AND, absolute, 4},     {"ROL", ROL, absolute, 6},     {"XXX", NULL, NULL, 2}, // 2-
-	{"BMI", BMI, relative, 2},  {"AND", AND, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"AND", AND, zero_offset_x, 4}, {"ROL", ROL, zero_offset_x, 6}, {"XXX", NULL, NULL, 2}, {"SEC", SEC, implied, 2}, {"AND", AND, abs_offset_y, 4}, {"XXX", NULL, NULL, 2},       {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"AND", AND, abs_offset_x, 4}, {"ROL", ROL, abs_offset_x, 7}, {"XXX", NULL, NULL, 2}, // 3-
-	{"RTI", RTI, implied, 6},   {"EOR", EOR, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"EOR", EOR, zero_page, 3},     {"LSR", LSR, zero_page, 5},     {"XXX", NULL, NULL, 2}, {"PHA", PHA, implied, 3}, {"EOR", EOR, immediate, 2},    {"LSR", LSR, accumulator, 2}, {"XXX", NULL, NULL, 2}, {"JMP", JMP, absolute, 3},     {"EOR", EOR, absolute, 4},     {"LSR", LSR, absolute, 6},     {"XXX", NULL, NULL, 2}, // 4-
-	{"BVC", BVC, relative, 2},  {"EOR", EOR, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"EOR", EOR, zero_offset_x, 4}, {"LSR", LSR, zero_offset_x, 6}, {"XXX", NULL, NULL, 2}, {"CLI", CLI, implied, 2}, {"EOR", EOR, abs_offset_y, 4}, {"XXX", NULL, NULL, 2},       {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"EOR", EOR, abs_offset_x, 4}, {"LSR", LSR, abs_offset_x, 7}, {"XXX", NULL, NULL, 2}, // 5-
-	{"RTS", RTS, implied, 6},   {"ADC", ADC, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"ADC", ADC, zero_page, 3},     {"ROR", ROR, zero_page, 5},     {"XXX", NULL, NULL, 2}, {"PLA", PLA, implied, 4}, {"ADC", ADC, immediate, 2},    {"ROR", ROR, accumulator, 2}, {"XXX", NULL, NULL, 2}, {"JMP", JMP, indirect, 5},     {"ADC", ADC, absolute, 4},     {"ROR", ROR, absolute, 6},     {"XXX", NULL, NULL, 2}, // 6-
-	{"BVS", BVS, relative, 2},  {"ADC", ADC, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"ADC", ADC, zero_offset_x, 4}, {"ROR", ROR, zero_offset_x, 6}, {"XXX", NULL, NULL, 2}, {"SEI", SEI, implied, 2}, {"ADC", ADC, abs_offset_y, 4}, {"XXX", NULL, NULL, 2},       {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"ADC", ADC, abs_offset_x, 4}, {"ROR", ROR, abs_offset_x, 7}, {"XXX", NULL, NULL, 2}, // 7-
-	{"XXX", NULL, NULL, 2},     {"STA", STA, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"STY", STY, zero_page, 3},     {"STA", STA, zero_page, 3},     {"STX", STX, zero_page, 3},     {"XXX", NULL, NULL, 2}, {"DEY", DEY, implied, 2}, {"XXX", NULL, NULL, 2},        {"TXA", TXA, implied, 2},     {"XXX", NULL, NULL, 2}, {"STY", STY, absolute, 4},     {"STA", STA, absolute, 4},     {"STX", STX, absolute, 4},     {"XXX", NULL, NULL, 2}, // 8-
-	{"BCC", BCC, relative, 2},  {"STA", STA, zero_indirect_y, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"STY", STY, zero_offset_x, 4}, {"STA", STA, zero_offset_x, 4}, {"STX", STX, zero_offset_y, 4}, {"XXX", NULL, NULL, 2}, {"TYA", TYA, implied, 2}, {"STA", STA, abs_offset_y, 5}, {"TXS", TXS, implied, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"STA", STA, abs_offset_x, 5}, {"XXX", NULL, NULL, 2},        {"XXX", NULL, NULL, 2}, // 9-
-	{"LDY", LDY, immediate, 2}, {"LDA", LDA, zero_indirect_x, 6}, {"LDX", LDX, immediate, 2}, {"XXX", NULL, NULL, 2}, {"LDY", LDY, zero_page, 3},     {"LDA", LDA, zero_page, 3},     {"LDX", LDX, zero_page, 3},     {"XXX", NULL, NULL, 2}, {"TAY", TAY, implied, 2}, {"LDA", LDA, immediate, 2},    {"TAX", TAX, implied, 2},     {"XXX", NULL, NULL, 2}, {"LDY", LDY, absolute, 4},     {"LDA", LDA, absolute, 4},     {"LDX", LDX, absolute, 4},     {"XXX", NULL, NULL, 2}, // A-
-	{"BCS", BCS, relative, 2},  {"LDA", LDA, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"LDY", LDY, zero_offset_x, 4}, {"LDA", LDA, zero_offset_x, 4}, {"LDX", LDX, zero_offset_y, 4}, {"XXX", NULL, NULL, 2}, {"CLV", CLV, implied, 2}, {"LDA", LDA, abs_offset_y, 4}, {"TSX", TSX, implied, 2},     {"XXX", NULL, NULL, 2}, {"LDY", LDY, abs_offset_x, 4}, {"LDA", LDA, abs_offset_x, 4}, {"LDX", LDX, abs_offset_y, 4}, {"XXX", NULL, NULL, 2}, // B-
-	{"CPY", CPY, immediate, 2}, {"CMP", CMP, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"CPY", CPY, zero_page, 3},     {"CMP", CMP, zero_page, 3},     {"DEC", DEC, zero_page, 5},     {"XXX", NULL, NULL, 2}, {"INY", INY, implied, 2}, {"CMP", CMP, immediate, 2},    {"DEX", DEX, implied, 2},     {"XXX", NULL, NULL, 2}, {"CPY", CPY, absolute, 4},     {"CMP", CMP, absolute, 4},     {"DEC", DEC, absolute, 6},     {"XXX", NULL, NULL, 2}, // C-
-	{"BNE", BNE, relative, 2},  {"CMP", CMP, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"CMP", CMP, zero_offset_x, 4}, {"DEC", DEC, zero_offset_x, 6}, {"XXX", NULL, NULL, 2}, {"CLD", CLD, implied, 2}, {"CMP", CMP, abs_offset_y, 4}, {"XXX", NULL, NULL, 2},       {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"CMP", CMP, abs_offset_x, 4}, {"DEC", DEC, abs_offset_x, 7}, {"XXX", NULL, NULL, 2}, // D-
-	{"CPX", CPX, immediate, 2}, {"SBC", SBC, zero_indirect_x, 6}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"CPX", CPX, zero_page, 3},     {"SBC", SBC, zero_page, 3},     {"INC", INC, zero_page, 5},     {"XXX", NULL, NULL, 2}, {"INX", INX, implied, 2}, {"SBC", SBC, immediate, 2},    {"NOP", NOP, implied, 2},     {"XXX", NULL, NULL, 2}, {"CPX", CPX, absolute, 4},     {"SBC", SBC, absolute, 4},     {"INC", INC, absolute, 6},     {"XXX", NULL, NULL, 2}, // E-
-	{"BEQ", BEQ, relative, 2},  {"SBC", SBC, zero_indirect_y, 5}, {"XXX", NULL, NULL, 2},     {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},         {"SBC", SBC, zero_offset_x, 4}, {"INC", INC, zero_offset_x, 6}, {"XXX", NULL, NULL, 2}, {"SED", SED, implied, 2}, {"SBC", SBC, abs_offset_y, 4}, {"XXX", NULL, NULL, 2},       {"XXX", NULL, NULL, 2}, {"XXX", NULL, NULL, 2},        {"SBC", SBC, abs_offset_x, 4}, {"INC", INC, abs_offset_x, 7}, {"XXX", NULL, NULL, 2}, // F-
+{// -0                          -1                                -2                          -3                      -4                              -5                              -6                              -7                      -8                        -9                             -A                              -B                      -C                             -D                             -E                             -F
+	{"BRK", BRK, implied, 7},   {"ORA", ORA, zero_indirect_x, 6}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},       {"ORA", ORA, zero_page, 3},     {"ASL", ASL, zero_page, 5},     {"XXX", JAM, implied, 2}, {"PHP", PHP, implied, 3}, {"ORA", ORA, immediate, 2},    {"ASL", ASL_A, accumulator, 2}, {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},      {"ORA", ORA, absolute, 4},     {"ASL", ASL, absolute, 6},     {"XXX", JAM, implied, 2}, // 2-
+	{"BPL", BPL, relative, 2},  {"ORA", ORA, zero_indirect_y, 5}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},       {"ORA", ORA, zero_offset_x, 4}, {"ASL", ASL, zero_offset_x, 6}, {"XXX", JAM, implied, 2}, {"CLC", CLC, implied, 2}, {"ORA", ORA, abs_offset_y, 4}, {"XXX", JAM, implied, 2},       {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},      {"ORA", ORA, abs_offset_x, 4}, {"ASL", ASL, abs_offset_x, 7}, {"XXX", JAM, implied, 2}, // 1-
+	{"JSR", JSR, absolute, 6},  {"AND", AND, zero_indirect_x, 6}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"BIT", BIT, zero_page, 3},     {"AND", AND, zero_page, 3},     {"ROL", ROL, zero_page, 5},     {"XXX", JAM, implied, 2}, {"PLP", PLP, implied, 4}, {"AND", AND, immediate, 2},    {"ROL", ROL_A, accumulator, 2}, {"XXX", JAM, implied, 2}, {"BIT", BIT, absolute, 4},     {"AND", AND, absolute, 4},     {"ROL", ROL, absolute, 6},     {"XXX", JAM, implied, 2}, // 2-
+	{"BMI", BMI, relative, 2},  {"AND", AND, zero_indirect_y, 5}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},       {"AND", AND, zero_offset_x, 4}, {"ROL", ROL, zero_offset_x, 6}, {"XXX", JAM, implied, 2}, {"SEC", SEC, implied, 2}, {"AND", AND, abs_offset_y, 4}, {"XXX", JAM, implied, 2},       {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},      {"AND", AND, abs_offset_x, 4}, {"ROL", ROL, abs_offset_x, 7}, {"XXX", JAM, implied, 2}, // 3-
+	{"RTI", RTI, implied, 6},   {"EOR", EOR, zero_indirect_x, 6}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},       {"EOR", EOR, zero_page, 3},     {"LSR", LSR, zero_page, 5},     {"XXX", JAM, implied, 2}, {"PHA", PHA, implied, 3}, {"EOR", EOR, immediate, 2},    {"LSR", LSR_A, accumulator, 2}, {"XXX", JAM, implied, 2}, {"JMP", JMP, absolute, 3},     {"EOR", EOR, absolute, 4},     {"LSR", LSR, absolute, 6},     {"XXX", JAM, implied, 2}, // 4-
+	{"BVC", BVC, relative, 2},  {"EOR", EOR, zero_indirect_y, 5}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},       {"EOR", EOR, zero_offset_x, 4}, {"LSR", LSR, zero_offset_x, 6}, {"XXX", JAM, implied, 2}, {"CLI", CLI, implied, 2}, {"EOR", EOR, abs_offset_y, 4}, {"XXX", JAM, implied, 2},       {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},      {"EOR", EOR, abs_offset_x, 4}, {"LSR", LSR, abs_offset_x, 7}, {"XXX", JAM, implied, 2}, // 5-
+	{"RTS", RTS, implied, 6},   {"ADC", ADC, zero_indirect_x, 6}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},       {"ADC", ADC, zero_page, 3},     {"ROR", ROR, zero_page, 5},     {"XXX", JAM, implied, 2}, {"PLA", PLA, implied, 4}, {"ADC", ADC, immediate, 2},    {"ROR", ROR_A, accumulator, 2}, {"XXX", JAM, implied, 2}, {"JMP", JMP, indirect, 5},     {"ADC", ADC, absolute, 4},     {"ROR", ROR, absolute, 6},     {"XXX", JAM, implied, 2}, // 6-
+	{"BVS", BVS, relative, 2},  {"ADC", ADC, zero_indirect_y, 5}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},       {"ADC", ADC, zero_offset_x, 4}, {"ROR", ROR, zero_offset_x, 6}, {"XXX", JAM, implied, 2}, {"SEI", SEI, implied, 2}, {"ADC", ADC, abs_offset_y, 4}, {"XXX", JAM, implied, 2},       {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},      {"ADC", ADC, abs_offset_x, 4}, {"ROR", ROR, abs_offset_x, 7}, {"XXX", JAM, implied, 2}, // 7-
+	{"XXX", JAM, implied, 2},   {"STA", STA, zero_indirect_x, 6}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"STY", STY, zero_page, 3},     {"STA", STA, zero_page, 3},     {"STX", STX, zero_page, 3},     {"XXX", JAM, implied, 2}, {"DEY", DEY, implied, 2}, {"XXX", JAM, implied, 2},      {"TXA", TXA, implied, 2},       {"XXX", JAM, implied, 2}, {"STY", STY, absolute, 4},     {"STA", STA, absolute, 4},     {"STX", STX, absolute, 4},     {"XXX", JAM, implied, 2}, // 8-
+	{"BCC", BCC, relative, 2},  {"STA", STA, zero_indirect_y, 6}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"STY", STY, zero_offset_x, 4}, {"STA", STA, zero_offset_x, 4}, {"STX", STX, zero_offset_y, 4}, {"XXX", JAM, implied, 2}, {"TYA", TYA, implied, 2}, {"STA", STA, abs_offset_y, 5}, {"TXS", TXS, implied, 2},       {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},      {"STA", STA, abs_offset_x, 5}, {"XXX", JAM, implied, 2},      {"XXX", JAM, implied, 2}, // 9-
+	{"LDY", LDY, immediate, 2}, {"LDA", LDA, zero_indirect_x, 6}, {"LDX", LDX, immediate, 2}, {"XXX", JAM, implied, 2}, {"LDY", LDY, zero_page, 3},     {"LDA", LDA, zero_page, 3},     {"LDX", LDX, zero_page, 3},     {"XXX", JAM, implied, 2}, {"TAY", TAY, implied, 2}, {"LDA", LDA, immediate, 2},    {"TAX", TAX, implied, 2},       {"XXX", JAM, implied, 2}, {"LDY", LDY, absolute, 4},     {"LDA", LDA, absolute, 4},     {"LDX", LDX, absolute, 4},     {"XXX", JAM, implied, 2}, // A-
+	{"BCS", BCS, relative, 2},  {"LDA", LDA, zero_indirect_y, 5}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"LDY", LDY, zero_offset_x, 4}, {"LDA", LDA, zero_offset_x, 4}, {"LDX", LDX, zero_offset_y, 4}, {"XXX", JAM, implied, 2}, {"CLV", CLV, implied, 2}, {"LDA", LDA, abs_offset_y, 4}, {"TSX", TSX, implied, 2},       {"XXX", JAM, implied, 2}, {"LDY", LDY, abs_offset_x, 4}, {"LDA", LDA, abs_offset_x, 4}, {"LDX", LDX, abs_offset_y, 4}, {"XXX", JAM, implied, 2}, // B-
+	{"CPY", CPY, immediate, 2}, {"CMP", CMP, zero_indirect_x, 6}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"CPY", CPY, zero_page, 3},     {"CMP", CMP, zero_page, 3},     {"DEC", DEC, zero_page, 5},     {"XXX", JAM, implied, 2}, {"INY", INY, implied, 2}, {"CMP", CMP, immediate, 2},    {"DEX", DEX, implied, 2},       {"XXX", JAM, implied, 2}, {"CPY", CPY, absolute, 4},     {"CMP", CMP, absolute, 4},     {"DEC", DEC, absolute, 6},     {"XXX", JAM, implied, 2}, // C-
+	{"BNE", BNE, relative, 2},  {"CMP", CMP, zero_indirect_y, 5}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},       {"CMP", CMP, zero_offset_x, 4}, {"DEC", DEC, zero_offset_x, 6}, {"XXX", JAM, implied, 2}, {"CLD", CLD, implied, 2}, {"CMP", CMP, abs_offset_y, 4}, {"XXX", JAM, implied, 2},       {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},      {"CMP", CMP, abs_offset_x, 4}, {"DEC", DEC, abs_offset_x, 7}, {"XXX", JAM, implied, 2}, // D-
+	{"CPX", CPX, immediate, 2}, {"SBC", SBC, zero_indirect_x, 6}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"CPX", CPX, zero_page, 3},     {"SBC", SBC, zero_page, 3},     {"INC", INC, zero_page, 5},     {"XXX", JAM, implied, 2}, {"INX", INX, implied, 2}, {"SBC", SBC, immediate, 2},    {"NOP", NOP, implied, 2},       {"XXX", JAM, implied, 2}, {"CPX", CPX, absolute, 4},     {"SBC", SBC, absolute, 4},     {"INC", INC, absolute, 6},     {"XXX", JAM, implied, 2}, // E-
+	{"BEQ", BEQ, relative, 2},  {"SBC", SBC, zero_indirect_y, 5}, {"XXX", JAM, implied, 2},   {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},       {"SBC", SBC, zero_offset_x, 4}, {"INC", INC, zero_offset_x, 6}, {"XXX", JAM, implied, 2}, {"SED", SED, implied, 2}, {"SBC", SBC, abs_offset_y, 4}, {"XXX", JAM, implied, 2},       {"XXX", JAM, implied, 2}, {"XXX", JAM, implied, 2},      {"SBC", SBC, abs_offset_x, 4}, {"INC", INC, abs_offset_x, 7}, {"XXX", JAM, implied, 2}, // F-
 };
 
 
 CPU *init_cpu()
 {
-	CPU *cpu = malloc(sizeof(CPU));
+	CPU *cpu = aligned_alloc(64, sizeof(CPU));
 	reset_cpu(cpu);
 	return cpu;
 }
@@ -52,15 +54,18 @@ CPU *init_cpu()
 void reset_cpu(CPU *cpu)
 {
 	memset(cpu, 0, sizeof(CPU));
-	cpu->U = 1;  // unused flag bit 5 is always 1
-	cpu->I = 1;
+	cpu->reg.U = 1;  // unused flag bit 5 is always 1
+	cpu->reg.I = 1;
+	cpu->irq_mask = 1;
+	cpu->fusion = 1;
+	memset(cpu->dirty, 0xFF, sizeof(cpu->dirty));
 
 	uint8_t little, big;
-	little = cpu->memory[RESET_LO];
-	big = cpu->memory[RESET_HI];
-	cpu->PC = (uint16_t)big << 8 | little;
+	little = peek(cpu, RESET_LO);
+	big = peek(cpu, RESET_HI);
+	cpu->reg.PC = (uint16_t)big << 8 | little;
 
-	cpu->SP = STK_PTR_START;
+	cpu->reg.SP = STK_PTR_START;
 	cpu->total_cycles = CPU_CLK_START;
 }
 
@@ -73,28 +78,28 @@ uint8_t get_flags(CPU *cpu)
 {
 	uint8_t result = 0x00;
 
-	result |= cpu->C << 0;
-	result |= cpu->Z << 1;
-	result |= cpu->I << 2;
-	result |= cpu->D << 3;
-	result |= cpu->B << 4;
-	result |= cpu->U << 5;
-	result |= cpu->V << 6;
-	result |= cpu->N << 7;
+	result |= cpu->reg.C << 0;
+	result |= cpu->reg.Z << 1;
+	result |= cpu->reg.I << 2;
+	result |= cpu->reg.D << 3;
+	result |= cpu->reg.B << 4;
+	result |= cpu->reg.U << 5;
+	result |= cpu->reg.V << 6;
+	result |= cpu->reg.N << 7;
 
 	return result;
 }
 
 void set_flags(CPU *cpu, uint8_t flags)
 {
-	cpu->C = flags & 1 << 0 ? 1 : 0;
-	cpu->Z = flags & 1 << 1 ? 1 : 0;
-	cpu->I = flags & 1 << 2 ? 1 : 0;
-	cpu->D = flags & 1 << 3 ? 1 : 0;
-	cpu->B = flags & 1 << 4 ? 1 : 0;
-	cpu->U = 1;  // always 1
-	cpu->V = flags & 1 << 6 ? 1 : 0;
-	cpu->N = flags & 1 << 7 ? 1 : 0;
+	cpu->reg.C = flags & 1 << 0 ? 1 : 0;
+	cpu->reg.Z = flags & 1 << 1 ? 1 : 0;
+	cpu->reg.I = flags & 1 << 2 ? 1 : 0;
+	cpu->reg.D = flags & 1 << 3 ? 1 : 0;
+	cpu->reg.B = flags & 1 << 4 ? 1 : 0;
+	cpu->reg.U = 1;  // always 1
+	cpu->reg.V = flags & 1 << 6 ? 1 : 0;
+	cpu->reg.N = flags & 1 << 7 ? 1 : 0;
 }
 
 void dump_cpu(CPU *cpu, FILE *f)
@@ -106,40 +111,61 @@ void dump_cpu(CPU *cpu, FILE *f)
 		printf("%02X ", cpu->memory[i]);
 	}
 
-	fprintf(f, "\nA:%02X X:%02X Y:%02X P:%02X SP:%02X  PPU: --, -- CYC:%u\n\n", cpu->A, cpu->X, cpu->Y, get_flags(cpu), cpu->SP, cpu->total_cycles);
-	fprintf(f, "Flags: NVUBDIZC\n       %d%d%d%d%d%d%d%d\n\n", cpu->N, cpu->V, cpu->U, cpu->B, cpu->D, cpu->I, cpu->Z, cpu->C);
+	fprintf(f, "\nA:%02X X:%02X Y:%02X P:%02X SP:%02X  PPU: --, -- CYC:%" PRIu64 "\n\n", cpu->reg.A, cpu->reg.X, cpu->reg.Y, get_flags(cpu), cpu->reg.SP, cpu->total_cycles);
+	fprintf(f, "Flags: NVUBDIZC\n       %d%d%d%d%d%d%d%d\n\n", cpu->reg.N, cpu->reg.V, cpu->reg.U, cpu->reg.B, cpu->reg.D, cpu->reg.I, cpu->reg.Z, cpu->reg.C);
+}
+
+static void stop(CPU *cpu, StopReason reason)
+{
+	cpu->stop = reason;
+	cpu->pending |= PENDING_STOP;
+}
+
+const char *stop_reason(StopReason reason)
+{
+	switch (reason)
+	{
+		case STOP_NONE:            return "Running";
+		case STOP_STACK_OVERFLOW:  return "Stack overflow";
+		case STOP_STACK_UNDERFLOW: return "Stack underflow";
+	}
+	return "Unknown stop";
 }
 
+// A wrapping stack is almost always a guest bug, so it stops the CPU
 void inc_stack_ptr(CPU *cpu)
 {
-	if (cpu->SP == 0xFF)
+	if (cpu->reg.SP == 0xFF)
 	{
-		fprintf(stderr, "[ERROR] Stack underflow; exiting...");
-		exit(EXIT_FAILURE);
+		stop(cpu, STOP_STACK_UNDERFLOW);
+		return;
 	}
-	cpu->SP++;
+	cpu->reg.SP++;
 }
 
 void dec_stack_ptr(CPU *cpu)
 {
-	if (cpu->SP == 0x00)
+	if (cpu->reg.SP == 0x00)
 	{
-		fprintf(stderr, "[ERROR] Stack overflow; exiting...");
-		exit(EXIT_FAILURE);
+		stop(cpu, STOP_STACK_OVERFLOW);
+		return;
 	}
-	cpu->SP--;
+	cpu->reg.SP--;
 }
 
 void stack_push(CPU *cpu, uint8_t value)
 {
-	cpu->memory[STACK_START + cpu->SP] = value;
+	cpu->memory[STACK_START + cpu->reg.SP] = value;
+	cpu->dirty[STACK_START >> 8] = 0xFF;
+	if (cpu->code_page[STACK_START >> 8])
+		invalidate_code(cpu, STACK_START + cpu->reg.SP, STACK_START + cpu->reg.SP);
 	dec_stack_ptr(cpu);
 }
 
 uint8_t stack_pop(CPU *cpu)
 {
 	inc_stack_ptr(cpu);
-	return cpu->memory[STACK_START + cpu->SP];
+	return cpu->memory[STACK_START + cpu->reg.SP];
 }
 
 void stack_push_word(CPU *cpu, uint16_t word)
@@ -181,271 +207,747 @@ uint8_t *read_file_as_bytes(char *file_name, size_t *file_len)
 }
 
 
-// 6502 assembler: https://www.masswerk.at/6502/assembler.html
-void run_program(CPU *cpu, FILE *logfile)
+// INTERRUPTS
+// Devices assert and release IRQ lines and drive the NMI input; everything is
+// folded into `pending`, so the run loop tests one byte per instruction no
+// matter how many sources there are.
+
+// Edge coverage for fuzzing: AFL's prev ^ cur scheme, with the target address
+// hashed into a location
+static inline void cover(CPU *cpu)
+{
+	if (cpu->coverage)
+	{
+		uint16_t cur = (uint16_t)(cpu->reg.PC * 0x9E3779B1u >> 16);
+		cpu->coverage[cur ^ cpu->prev_loc]++;
+		cpu->prev_loc = cur >> 1;
+	}
+}
+
+static void update_pending(CPU *cpu)
+{
+	if (cpu->irq_lines && !cpu->irq_mask)
+		cpu->pending |= PENDING_IRQ;
+	else
+		cpu->pending &= ~PENDING_IRQ;
+}
+
+// IRQ is level-triggered and wired-OR: it stays pending while any line is asserted
+void irq_assert(CPU *cpu, uint32_t lines)
+{
+	cpu->irq_lines |= lines;
+	update_pending(cpu);
+}
+
+void irq_release(CPU *cpu, uint32_t lines)
+{
+	cpu->irq_lines &= ~lines;
+	update_pending(cpu);
+}
+
+static uint16_t read_vector(CPU *cpu, uint16_t addr)
+{
+	return (uint16_t)peek(cpu, addr + 1) << 8 | peek(cpu, addr);
+}
+
+// NMI is edge-triggered: a rising edge at `cycle` is latched until serviced.
+// An edge before the vector fetch of an IRQ or BRK sequence hijacks it; the
+// pushes stand, but the CPU fetches the NMI vector instead.
+void nmi_set(CPU *cpu, uint8_t level, uint64_t cycle)
+{
+	if (level && !cpu->nmi_line)
+	{
+		if (cycle < cpu->irq_start + 5)
+		{
+			cpu->reg.PC = read_vector(cpu, NMI_LO);
+			cpu->irq_start = 0;
+		}
+		else
+			cpu->pending |= PENDING_NMI;
+	}
+	cpu->nmi_line = level;
+}
+
+// The 7-cycle sequence shared by IRQ, NMI and BRK: push PC and P, set I and jump
+// through the vector. Only BRK sets B in the pushed copy of P.
+static void interrupt(CPU *cpu, uint16_t vector, uint8_t brk)
+{
+	stack_push_word(cpu, cpu->reg.PC);
+	stack_push(cpu, (get_flags(cpu) & ~(1 << 4)) | 1 << 5 | brk << 4);
+
+	cpu->reg.I = 1;
+	cpu->irq_mask = 1;
+	update_pending(cpu);
+
+	cpu->reg.PC = read_vector(cpu, vector);
+	cpu->idle.valid = 0;
+	cover(cpu);
+}
+
+// Runs between instructions whenever `pending` is set. Returns 1 if an
+// interrupt sequence took the place of the next instruction.
+static int poll_interrupts(CPU *cpu)
+{
+	uint8_t pending = cpu->pending;
+
+	// the poll that just happened still saw the old I
+	if (pending & PENDING_POLL)
+	{
+		cpu->pending &= ~PENDING_POLL;
+		cpu->irq_mask = cpu->reg.I;
+		update_pending(cpu);
+	}
+
+	if (pending & PENDING_NMI)
+	{
+		cpu->pending &= ~PENDING_NMI;
+		cpu->total_cycles += 7;
+		interrupt(cpu, NMI_LO, 0);
+		return 1;
+	}
+	if (pending & PENDING_IRQ)
+	{
+		cpu->irq_start = cpu->total_cycles;
+		cpu->total_cycles += 7;
+		interrupt(cpu, IRQ_LO, 0);
+		return 1;
+	}
+	return 0;
+}
+
+
+// SUPERINSTRUCTIONS
+// A few short sequences (loop tails, copies, pointer walks) make up much of
+// guest code, so each is run by one handler and costs one dispatch instead of
+// two or three. The set comes from `main -P` pair profiles. Sequences are
+// recognised the first time their address runs and keyed by the address of the
+// first instruction: jumping into the middle of one just runs the plain
+// instructions from there, and a write into one sends it back through decode.
+
+#define DECODED_PLAIN  1
+#define FUSE_SPAN      9   // most bytes a sequence can cover
+
+typedef struct Superinstruction
+{
+	uint8_t opcodes[3];
+	uint8_t count;
+	void (*run)(CPU *);
+} Superinstruction;
+
+static inline __attribute__((always_inline)) void fused_step(CPU *cpu, void (*op)(CPU *, uint16_t), uint16_t (*mode)(CPU *), uint8_t opcode)
+{
+	cpu->total_cycles += instruction_table[opcode].clock_cycles;
+	cpu->instructions++;
+	op(cpu, mode(cpu));
+}
+
+// The rest of a sequence runs only if nothing has to happen between
+// instructions, the slice isn't over and the code wasn't just overwritten
+static inline int fuse_next(CPU *cpu, uint16_t start)
+{
+	if (cpu->pending || cpu->total_cycles >= cpu->next_event || !cpu->decoded[start])
+		return 0;
+	cpu->fused++;
+	return 1;
+}
+
+static void lda_imm_sta_abs(CPU *cpu)
+{
+	uint16_t start = cpu->reg.PC;
+	fused_step(cpu, LDA, immediate, 0xA9);
+	if (fuse_next(cpu, start))
+		fused_step(cpu, STA, absolute, 0x8D);
+}
+
+static void lda_imm_sta_zp(CPU *cpu)
 {
-	uint8_t opcode;
-	Instruction *current_inst;
-	dump_cpu(cpu, stdout);
+	uint16_t start = cpu->reg.PC;
+	fused_step(cpu, LDA, immediate, 0xA9);
+	if (fuse_next(cpu, start))
+		fused_step(cpu, STA, zero_page, 0x85);
+}
+
+static void lda_ind_y_sta_ind_y(CPU *cpu)
+{
+	uint16_t start = cpu->reg.PC;
+	fused_step(cpu, LDA, zero_indirect_y, 0xB1);
+	if (fuse_next(cpu, start))
+		fused_step(cpu, STA, zero_indirect_y, 0x91);
+}
+
+static void cmp_imm_bne(CPU *cpu)
+{
+	uint16_t start = cpu->reg.PC;
+	fused_step(cpu, CMP, immediate, 0xC9);
+	if (fuse_next(cpu, start))
+		fused_step(cpu, BNE, relative, 0xD0);
+}
+
+static void cmp_zp_beq(CPU *cpu)
+{
+	uint16_t start = cpu->reg.PC;
+	fused_step(cpu, CMP, zero_page, 0xC5);
+	if (fuse_next(cpu, start))
+		fused_step(cpu, BEQ, relative, 0xF0);
+}
+
+static void dex_bne(CPU *cpu)
+{
+	uint16_t start = cpu->reg.PC;
+	fused_step(cpu, DEX, implied, 0xCA);
+	if (fuse_next(cpu, start))
+		fused_step(cpu, BNE, relative, 0xD0);
+}
+
+static void dey_bne(CPU *cpu)
+{
+	uint16_t start = cpu->reg.PC;
+	fused_step(cpu, DEY, implied, 0x88);
+	if (fuse_next(cpu, start))
+		fused_step(cpu, BNE, relative, 0xD0);
+}
+
+static void iny_bne(CPU *cpu)
+{
+	uint16_t start = cpu->reg.PC;
+	fused_step(cpu, INY, implied, 0xC8);
+	if (fuse_next(cpu, start))
+		fused_step(cpu, BNE, relative, 0xD0);
+}
+
+static void iny_cpy_imm_bne(CPU *cpu)
+{
+	uint16_t start = cpu->reg.PC;
+	fused_step(cpu, INY, implied, 0xC8);
+	if (!fuse_next(cpu, start))
+		return;
+	fused_step(cpu, CPY, immediate, 0xC0);
+	if (fuse_next(cpu, start))
+		fused_step(cpu, BNE, relative, 0xD0);
+}
 
-	fprintf(logfile, "\n");
-	for (size_t inst_count = 0; cpu->PC < 0xFFFF; ++inst_count) 
+static const Superinstruction superinstructions[] =
+{
+	{{0xA9, 0x8D}, 2, lda_imm_sta_abs},       // LDA #imm / STA abs
+	{{0xA9, 0x85}, 2, lda_imm_sta_zp},        // LDA #imm / STA zp
+	{{0xB1, 0x91}, 2, lda_ind_y_sta_ind_y},   // LDA (zp),Y / STA (zp),Y
+	{{0xC9, 0xD0}, 2, cmp_imm_bne},           // CMP #imm / BNE
+	{{0xC5, 0xF0}, 2, cmp_zp_beq},            // CMP zp / BEQ
+	{{0xCA, 0xD0}, 2, dex_bne},               // DEX / BNE
+	{{0x88, 0xD0}, 2, dey_bne},               // DEY / BNE
+	{{0xC8, 0xD0}, 2, iny_bne},               // INY / BNE
+	{{0xC8, 0xC0, 0xD0}, 3, iny_cpy_imm_bne}, // INY / CPY #imm / BNE
+};
+#define N_SUPERINSTRUCTIONS (sizeof(superinstructions) / sizeof(superinstructions[0]))
+
+// Decide what runs at `pc`, marking the pages the sequence covers as code
+static uint8_t decode(CPU *cpu, uint16_t pc)
+{
+	uint8_t result = DECODED_PLAIN;
+	uint16_t end = pc + inst_length(&instruction_table[peek(cpu, pc)]);
+
+	for (size_t i = 0; cpu->fusion && i < N_SUPERINSTRUCTIONS; i++)
+	{
+		const Superinstruction *super = &superinstructions[i];
+		uint16_t addr = pc;
+		uint8_t n = 0;
+
+		while (n < super->count && peek(cpu, addr) == super->opcodes[n])
+			addr += inst_length(&instruction_table[super->opcodes[n++]]);
+		if (n == super->count && addr > pc)
+		{
+			result = DECODED_PLAIN + 1 + i;
+			end = addr;
+			break;
+		}
+	}
+
+	// only superinstructions go stale when the code changes
+	if (result != DECODED_PLAIN)
 	{
-		fprintf(logfile, "-----------RESULT OF INST %lu-----------\n\n", inst_count);
-		fprintf(logfile, "%04X: ", cpu->PC);
+		cpu->code_page[pc >> 8] = 1;
+		cpu->code_page[(uint16_t)(end - 1) >> 8] = 1;
+	}
+	cpu->decoded[pc] = result;
+	return result;
+}
 
-		cpu->operand = 0x0000;
+// Forget any decoded sequence that covers [first, last]
+void invalidate_code(CPU *cpu, uint16_t first, uint16_t last)
+{
+	for (uint32_t addr = (uint32_t)first + 0x10000 - (FUSE_SPAN - 1); addr <= (uint32_t)last + 0x10000; addr++)
+		cpu->decoded[(uint16_t)addr] = 0;
+}
 
-		opcode = cpu->memory[cpu->PC];
-		current_inst = &instruction_table[opcode];
-		cpu->current_inst = current_inst;
 
-		cpu->current_cycles += current_inst->clock_cycles;
-		cpu->total_cycles   += current_inst->clock_cycles;
+static inline void step(CPU *cpu)
+{
+	Instruction *inst = &instruction_table[peek(cpu, cpu->reg.PC)];
+	cpu->total_cycles += inst->clock_cycles;
+	cpu->instructions++;
 
-		current_inst->addr_mode(cpu);
-		current_inst->operation(cpu);
+	inst->operation(cpu, inst->addr_mode(cpu));
+}
+
+// step(), but through a superinstruction if one starts here
+static inline void dispatch(CPU *cpu)
+{
+	uint8_t decoded = cpu->decoded[cpu->reg.PC];
+	if (!decoded)
+		decoded = decode(cpu, cpu->reg.PC);
 
-		
+	if (decoded == DECODED_PLAIN)
+		step(cpu);
+	else
+		superinstructions[decoded - DECODED_PLAIN - 1].run(cpu);
+}
+
+static void count_pair(CPU *cpu)
+{
+	uint8_t opcode = peek(cpu, cpu->reg.PC);
+	cpu->pair_counts[(uint16_t)cpu->last_opcode << 8 | opcode]++;
+	cpu->last_opcode = opcode;
+}
+
+// Run until PC reaches 0xFFFF or the CPU jams, writing a binary trace of every
+// instruction to logfile unless it's NULL
+// 6502 assembler: https://www.masswerk.at/6502/assembler.html
+void run_program(CPU *cpu, FILE *logfile)
+{
+	Trace *trace = logfile ? trace_open(logfile) : NULL;
+	PerfPhase *phase = cpu->perf ? perf_phase(cpu->perf, "run_program") : NULL;
 
-		if (inst_count > 3363)
+	if (phase)
+		perf_begin(cpu->perf, phase, cpu->instructions);
+	while (cpu->reg.PC < 0xFFFF && !cpu->jammed)
+	{
+		if (cpu->pending)
 		{
-			dump_cpu(cpu, stdout);
-			getchar();
+			if (cpu->pending & PENDING_STOP)
+				break;
+			if (poll_interrupts(cpu))
+				continue;
 		}
+		if (trace)
+			trace_push(trace, cpu);
+		step(cpu);
+	}
+	if (phase)
+		perf_end(cpu->perf, phase, cpu->instructions);
 
-		// TODO - implement clock
-		while (cpu->current_cycles)
-			cpu->current_cycles--;
+	if (trace)
+		trace_close(trace);
+}
+
+// Run until total_cycles reaches `cycle`, the next scheduled event. Nothing outside
+// the CPU changes before then, so idle loops can be skipped up to that point. An
+// I/O handler that schedules something sooner lowers next_event, which ends the
+// slice there instead.
+void run_until(CPU *cpu, uint64_t cycle)
+{
+	cpu->next_event = cycle;
+	cpu->idle.valid = 0;  // memory may have changed since the last slice
 
+	// tracing, profiling and single-stepping get their own loop, one instruction
+	// at a time, so the plain one pays nothing for them
+	if (cpu->trace || cpu->pair_counts || cpu->single_step)
+	{
+		while (cpu->total_cycles < cpu->next_event)
+		{
+			if (cpu->pending)
+			{
+				if (cpu->pending & PENDING_STOP)
+					break;
+				if (poll_interrupts(cpu))
+					continue;
+			}
+			if (cpu->trace)
+				trace_push(cpu->trace, cpu);
+			if (cpu->pair_counts)
+				count_pair(cpu);
+			step(cpu);
+		}
 	}
-	
+	else
+	{
+		while (cpu->total_cycles < cpu->next_event)
+		{
+			if (cpu->pending)
+			{
+				if (cpu->pending & PENDING_STOP)
+					break;
+				if (poll_interrupts(cpu))
+					continue;
+			}
+			dispatch(cpu);
+		}
+	}
+
+	cpu->next_event = 0;
 }
 
 
-int main(void)
+// MEMORY
+// Pages with an I/O handler go through it; everything else is plain memory
+
+void map_io(CPU *cpu, uint8_t first_page, uint8_t last_page, ReadHandler read, WriteHandler write, void *data)
+{
+	for (unsigned page = first_page; page <= last_page; page++)
+	{
+		cpu->io_read[page] = read;
+		cpu->io_write[page] = write;
+		cpu->io_data[page] = data;
+	}
+}
+
+static uint8_t *read_page(CPU *cpu, uint8_t **set, size_t page)
 {
-	size_t file_len;
-	char *fname = "nestest.nes";
-	uint8_t *bytes = read_file_as_bytes(fname, &file_len);
+	return set ? set[page] : &cpu->memory[page * BYTES_PER_PAGE];
+}
 
-	assembly_outfile = stdout;
-	if (assembly_outfile == NULL) 
+// Point reads of every page at `set` (PAGES pointers to 256 bytes each, kept
+// alive by the caller), or back at plain memory for NULL. Only the pointer
+// changes hands, so flipping banks is O(1) in the size of the banks; code
+// decoded from a page that now reads elsewhere is forgotten.
+void map_reads(CPU *cpu, uint8_t **set)
+{
+	for (size_t group = 0; group < PAGES; group += 8)
 	{
-		perror("fopen outfile");
-		exit(EXIT_FAILURE);
+		uint64_t decoded;  // eight code_page flags at once; usually all clear
+		memcpy(&decoded, &cpu->code_page[group], 8);
+		if (!decoded)
+			continue;
+		for (size_t page = group; page < group + 8; page++)
+			if (cpu->code_page[page] && read_page(cpu, set, page) != read_page(cpu, cpu->read_map, page))
+				invalidate_code(cpu, page * BYTES_PER_PAGE, page * BYTES_PER_PAGE + BYTES_PER_PAGE - 1);
 	}
+	cpu->read_map = set;
+	cpu->idle.valid = 0;
+}
 
-	CPU *cpu = init_cpu();
+// The 6510's port: $00 sets which of the six pins are outputs, $01 drives
+// them. Pins left as inputs read high on bits 0-2 and 4 (the banking lines and
+// the cassette sense), so after a reset the port reads 0x17.
+#define PORT_PINS     0x3F
+#define PORT_PULLUPS  0x17
 
-	memcpy(&cpu->memory[0x8000], bytes + 0x0010, 0xC000 - 0x8000);
-	memcpy(&cpu->memory[0xC000], bytes + 0x0010, 0xC000 - 0x8000);
-	cpu->PC = 0xC000;
+static void update_port(CPU *cpu)
+{
+	uint8_t pins = ((cpu->port_out & cpu->port_ddr) | (PORT_PULLUPS & ~cpu->port_ddr)) & PORT_PINS;
+	cpu->memory[0] = cpu->port_ddr;
+	cpu->memory[1] = pins;
+	cpu->port_handler(cpu->port_owner, pins);
+}
 
-	run_program(cpu, stdout);
+void map_port(CPU *cpu, PortHandler handler, void *owner)
+{
+	cpu->port_handler = handler;
+	cpu->port_owner = owner;
+	cpu->port_ddr = 0;
+	cpu->port_out = 0;
+	if (handler)
+		update_port(cpu);
+}
 
-	fclose(assembly_outfile);
-	delete_cpu(cpu);
-	return 0;
+uint8_t peek_banked(CPU *cpu, uint16_t addr)
+{
+	return cpu->read_map[addr >> 8][addr & 0xFF];
+}
+
+uint8_t read_byte(CPU *cpu, uint16_t addr)
+{
+	ReadHandler read = cpu->io_read[addr >> 8];
+	return read ? read(cpu->io_data[addr >> 8], addr) : peek(cpu, addr);
 }
 
+void write_byte(CPU *cpu, uint16_t addr, uint8_t value)
+{
+	WriteHandler write = cpu->io_write[addr >> 8];
+	cpu->dirty[addr >> 8] = 0xFF;  // handlers may store to memory too
+	if (write)
+		write(cpu->io_data[addr >> 8], addr, value);
+	else
+	{
+		cpu->memory[addr] = value;  // under a ROM bank this is the RAM below it
+		if (cpu->code_page[addr >> 8])
+			invalidate_code(cpu, addr, addr);
+		if (addr < 2 && cpu->port_handler)
+		{
+			if (addr)
+				cpu->port_out = value;
+			else
+				cpu->port_ddr = value;
+			update_port(cpu);
+		}
+	}
+}
 
 /* 
 ADDRESSING MODES
 see: https://rosettacode.org/wiki/Category:6502_Assembly#Addressing_Modes
 more: http://www.emulator101.com/6502-addressing-modes.html
+
+Each mode advances PC and returns the effective address; the operation reads
+it (once) only if it needs the value, so stores never touch their target first.
 */
 
 // Implied instructions have no operands
-void implied(CPU *cpu)
+uint16_t implied(CPU *cpu)
 {
-	cpu->PC += 1;
-	
-	fprintf(assembly_outfile, "%s\n", cpu->current_inst->name);
+	cpu->reg.PC += 1;
+	return 0;
 }
 
 // Operand is accumulator
-void accumulator(CPU *cpu)
+uint16_t accumulator(CPU *cpu)
 {
-	
-	cpu->operand = cpu->A;
-	cpu->PC += 1;
-
-	fprintf(assembly_outfile, "%s A\n", cpu->current_inst->name);
+	cpu->reg.PC += 1;
+	return 0;
 }
 
 // The operand of an immediate instruction is only one byte, and denotes a constant value
-void immediate(CPU *cpu)
+uint16_t immediate(CPU *cpu)
 {
-	cpu->operand = cpu->memory[cpu->PC + 1];
-	cpu->jmp_addr = cpu->operand;
-	cpu->PC += 2;
-
-	fprintf(assembly_outfile, "%s #$%02X\n", cpu->current_inst->name, cpu->operand);
+	uint16_t addr = cpu->reg.PC + 1;
+	cpu->reg.PC += 2;
+	return addr;
 }
 
 // The operand of a zeropage instruction is one byte, and denotes an address in the zero page
-void zero_page(CPU *cpu)
+uint16_t zero_page(CPU *cpu)
 {
-	fprintf(assembly_outfile, "%s $%02X\n", cpu->current_inst->name, cpu->memory[cpu->PC + 1]);
-
-	cpu->jmp_addr = (uint16_t)cpu->memory[cpu->PC + 1] & 0x00FF;
-	cpu->operand = cpu->memory[cpu->memory[cpu->PC + 1]];
-	cpu->PC += 2;
+	uint16_t addr = peek(cpu, cpu->reg.PC + 1);
+	cpu->reg.PC += 2;
+	return addr;
 }
 
 // The operand of an absolute instruction is two bytes, and denotes an address in memory
-void absolute(CPU *cpu)
+uint16_t absolute(CPU *cpu)
 {
 	uint8_t little, big;
-	little = cpu->memory[cpu->PC + 1];
-	big = cpu->memory[cpu->PC + 2];
-	uint16_t addr = (uint16_t)big << 8 | little;
-
-	cpu->jmp_addr = addr;
+	little = peek(cpu, cpu->reg.PC + 1);
+	big = peek(cpu, cpu->reg.PC + 2);
+	cpu->reg.PC += 3;
 
-	cpu->operand = cpu->memory[addr];
-	cpu->PC += 3;
-
-	fprintf(assembly_outfile, "%s $%02X%02X\n", cpu->current_inst->name, big, little);
+	return (uint16_t)big << 8 | little;
 }
 
 // Indirect: operand is address; effective address is contents of word at address
 // only used by JMP
-void indirect(CPU *cpu)
+uint16_t indirect(CPU *cpu)
 {
 	uint8_t little, big;
-	little = cpu->memory[cpu->PC + 1];
-	big = cpu->memory[cpu->PC + 2];
+	little = peek(cpu, cpu->reg.PC + 1);
+	big = peek(cpu, cpu->reg.PC + 2);
 	uint16_t addr = (uint16_t)big << 8 | little;
 
-	fprintf(assembly_outfile, "%s ($%02X%02X)\n", cpu->current_inst->name, big, little);
 	if (little == 0xFF)
-		big = cpu->memory[addr - 0xFF]; // no carry bug
+		big = peek(cpu, addr - 0xFF); // no carry bug
 	else  
-		big = cpu->memory[addr + 1];
-	little = cpu->memory[addr];
+		big = peek(cpu, addr + 1);
+	little = peek(cpu, addr);
 
-	cpu->jmp_addr = (uint16_t)big << 8 | little;
-	cpu->operand = cpu->memory[cpu->jmp_addr];
-	cpu->PC += 3;
+	cpu->reg.PC += 3;
+	return (uint16_t)big << 8 | little;
 }
 
-// Set the operand to PC + the *signed* byte in the next 
-void relative(CPU *cpu)
+// The branch target: PC + the *signed* byte in the next 
+uint16_t relative(CPU *cpu)
 {
-	uint8_t offset = cpu->memory[cpu->PC + 1];
-
-	cpu->operand = offset;
-	// cpu->jmp_addr = cpu->PC + (int8_t)offset;
-	// printf("%u = %u + %d   %u  %d\n", cpu->jmp_addr, cpu->PC, (int8_t)offset, offset, offset);
-	cpu->PC += 2;
-	fprintf(assembly_outfile, "%s $%04X\n", cpu->current_inst->name, cpu->PC + (int8_t)offset);
+	uint8_t offset = peek(cpu, cpu->reg.PC + 1);
+	cpu->reg.PC += 2;
+	return cpu->reg.PC + (int8_t)offset;
 }
 
 // A zero page memory address offset by X
-void zero_offset_x(CPU *cpu)
+uint16_t zero_offset_x(CPU *cpu)
 {
-	fprintf(assembly_outfile, "%s $%02X,X\n", cpu->current_inst->name, cpu->memory[cpu->PC + 1]);
-
-	uint8_t index = (cpu->memory[cpu->PC + 1] + cpu->X) % 256;
-	cpu->jmp_addr = (uint16_t)index & 0x00FF;	
-	cpu->operand = cpu->memory[index];
-	cpu->PC += 2;
+	uint8_t index = peek(cpu, cpu->reg.PC + 1) + cpu->reg.X;
+	cpu->reg.PC += 2;
+	return index;
 }
 
 // A zero page memory address offset by Y
-void zero_offset_y(CPU *cpu)
+uint16_t zero_offset_y(CPU *cpu)
 {
-	fprintf(assembly_outfile, "%s $%02X,Y\n", cpu->current_inst->name, cpu->memory[cpu->PC + 1]);
-
-	uint8_t index = (cpu->memory[cpu->PC + 1] + cpu->Y) % 256;
+	uint8_t index = peek(cpu, cpu->reg.PC + 1) + cpu->reg.Y;
+	cpu->reg.PC += 2;
+	return index;
+}
 
-	cpu->jmp_addr = (uint16_t)index;
+// An absolute memory address offset by X
+uint16_t abs_offset_x(CPU *cpu)
+{
+	return absolute(cpu) + cpu->reg.X;
+}
 
-	cpu->operand = cpu->memory[index];
-	cpu->PC += 2;
+// An absolute memory address offset by Y
+uint16_t abs_offset_y(CPU *cpu)
+{
+	return absolute(cpu) + cpu->reg.Y;
 }
 
-// An absolute memory address offset by X
-void abs_offset_x(CPU *cpu)
+uint16_t zero_indirect_x(CPU *cpu)
 {
-	uint8_t little, big;
-	little = cpu->memory[cpu->PC + 1];
-	big = cpu->memory[cpu->PC + 2];
-	uint16_t addr = (uint16_t)big << 8 | little;
+	uint8_t little, big, addr;
+	addr = peek(cpu, cpu->reg.PC + 1) + cpu->reg.X;
+	cpu->reg.PC += 2;
 
-	fprintf(assembly_outfile, "%s $%02X%02X,X\n", cpu->current_inst->name, little, big);
+	// "Increments without carry do not affect the hi-byte of an address and no page transitions do occur"
+	little = cpu->memory[addr];
+	big = cpu->memory[(uint8_t)(addr + 1)];
 
-	cpu->jmp_addr = addr + (uint16_t)cpu->X;
-	cpu->operand = cpu->memory[cpu->jmp_addr];
-	cpu->PC += 3;
+	return (uint16_t)big << 8 | little;
 }
 
-// An absolute memory address offset by Y
-void abs_offset_y(CPU *cpu)
+uint16_t zero_indirect_y(CPU *cpu)
 {
-	uint8_t little, big;
-	little = cpu->memory[cpu->PC + 1];
-	big = cpu->memory[cpu->PC + 2];
-	uint16_t addr = (uint16_t)big << 8 | little;
+	uint8_t little, big, val;
+	val = peek(cpu, cpu->reg.PC + 1);
+	cpu->reg.PC += 2;
+
+	little = cpu->memory[val];
+	big = cpu->memory[(uint8_t)(val + 1)];
+
+	return ((uint16_t)big << 8 | little) + cpu->reg.Y;
+}
 
-	fprintf(assembly_outfile, "%s $%02X%02X,Y\n", cpu->current_inst->name, little, big);
 
-	cpu->jmp_addr = addr + (uint16_t)cpu->Y;
-	cpu->operand = cpu->memory[cpu->jmp_addr];
-	cpu->PC += 3;
+// IDLE LOOPS
+// Games spend most of a frame in loops like `JMP *`, `BIT $2002 / BPL` or
+// `LDA mem / BEQ` waiting for an interrupt. If the same backward edge is taken
+// twice in a row with identical registers and the loop body can't write memory,
+// every further iteration is identical until something outside the CPU changes,
+// so whole iterations are skipped up to the next scheduled event. Not while
+// tracing, which promises a record for every instruction.
+
+uint8_t inst_length(Instruction *inst)
+{
+	if (inst->addr_mode == absolute || inst->addr_mode == indirect ||
+	    inst->addr_mode == abs_offset_x || inst->addr_mode == abs_offset_y)
+		return 3;
+	if (inst->addr_mode == implied || inst->addr_mode == accumulator)
+		return 1;
+	return 2;
 }
 
-void zero_indirect_x(CPU *cpu)
+static uint8_t is_branch(Instruction *inst)
 {
+	return inst->addr_mode == relative;
+}
 
-	uint8_t little, big, addr, *val;
-	addr = cpu->memory[cpu->PC + 1] + cpu->X;
-	val = &cpu->memory[addr];
-	little = *val;
-	// "Increments without carry do not affect the hi-byte of an address and no page transitions do occur"
-	if (addr == 0xFF)
-		big = cpu->memory[0x00];
-	else
-		big = *(val + 1);
-	uint16_t final_addr = (uint16_t)big << 8 | little;
+// Instructions that write memory, use the stack or jam the CPU
+static uint8_t is_impure(Instruction *inst)
+{
+	void (*op)(CPU *, uint16_t) = inst->operation;
 
-	fprintf(assembly_outfile, "%s ($%02X,X)\n", cpu->current_inst->name, cpu->memory[cpu->PC + 1]);
+	if (op == JAM)
+		return 1;
+	if (op == STA || op == STX || op == STY || op == INC || op == DEC)
+		return 1;
+	if (op == ASL || op == ROL || op == LSR || op == ROR)
+		return 1;
+	return op == BRK || op == JSR || op == RTI || op == RTS ||
+	       op == PHA || op == PHP || op == PLA || op == PLP;
+}
+
+// A load from an I/O page can return something new, or have a side effect, on
+// any iteration unless its device marked the page io_scheduled. Indirect loads
+// aren't resolved and count as I/O.
+static uint8_t reads_io(CPU *cpu, Instruction *inst, uint16_t addr)
+{
+	uint16_t (*mode)(CPU *) = inst->addr_mode;
+
+	if (mode == implied || mode == accumulator || mode == immediate || mode == relative)
+		return 0;
+	if (mode == zero_indirect_x || mode == zero_indirect_y)
+		return 1;
 
-	cpu->jmp_addr = final_addr;
+	uint16_t base = 0;
+	if (mode == absolute || mode == abs_offset_x || mode == abs_offset_y)
+		base = (uint16_t)peek(cpu, addr + 2) << 8 | peek(cpu, addr + 1);
+	uint8_t first = base >> 8;
+	uint8_t last = mode == abs_offset_x || mode == abs_offset_y ? (uint16_t)(base + 0xFF) >> 8 : first;
 
-	cpu->operand = cpu->memory[final_addr];
-	cpu->PC += 2;
+	return (cpu->io_read[first] && !cpu->io_scheduled[first]) ||
+	       (cpu->io_read[last] && !cpu->io_scheduled[last]);
 }
 
-void zero_indirect_y(CPU *cpu)
+// The body [head, end) may only contain pure instructions, branches that stay
+// inside it, and a final JMP back to head
+static uint8_t loop_is_pure(CPU *cpu, uint16_t head, uint16_t end)
 {
-	uint8_t little, big, val;
-	val = cpu->memory[cpu->PC + 1];
-	little = cpu->memory[val];
-	if (val == 0xFF)
+	if ((uint16_t)(end - head) > IDLE_MAX_BODY)
+		return 0;
+
+	for (uint16_t addr = head; addr < end; )
 	{
-		big = cpu->memory[0x00];
-	} else
-		big = cpu->memory[val + 1];
-	
-	uint16_t addr = (uint16_t)big << 8 | little;
+		Instruction *inst = &instruction_table[peek(cpu, addr)];
+		uint8_t len = inst_length(inst);
 
+		if (inst->operation == JMP)
+		{
+			if (inst->addr_mode != absolute || addr + len != end)
+				return 0;
+		}
+		else if (is_branch(inst))
+		{
+			uint16_t target = addr + 2 + (int8_t)peek(cpu, addr + 1);
+			if (target < head || target > end)
+				return 0;
+		}
+		else if (is_impure(inst) || reads_io(cpu, inst, addr))
+			return 0;
 
-	fprintf(assembly_outfile, "%s ($%02X),Y\n", cpu->current_inst->name, cpu->memory[cpu->PC + 1]);	
+		addr += len;
+		if (addr > end)
+			return 0;
+	}
+	return 1;
+}
+
+static void idle_check(CPU *cpu, uint16_t head, uint16_t end)
+{
+	IdleLoop *loop = &cpu->idle;
 
-	cpu->jmp_addr = addr + ((uint16_t)cpu->Y & 0x00FF);
-	printf("%04X %04X\n", addr, cpu->jmp_addr);
+	if (!loop->valid || loop->head != head || loop->end != end)
+	{
+		loop->head = head;
+		loop->end = end;
+		loop->valid = 1;
+		loop->pure = loop_is_pure(cpu, head, end);
+	}
+	else if (loop->pure && cpu->next_event && !cpu->pending && !cpu->trace && !memcmp(&loop->reg, &cpu->reg, sizeof(Registers)))
+	{
+		uint64_t period = cpu->total_cycles - loop->cycles;
+		if (period && cpu->next_event > cpu->total_cycles)
+			cpu->total_cycles += (cpu->next_event - cpu->total_cycles) / period * period;
+	}
+
+	loop->reg = cpu->reg;
+	loop->cycles = cpu->total_cycles;
+}
+
+static void branch(CPU *cpu, uint8_t taken, uint16_t target)
+{
+	if (!taken)
+	{
+		cover(cpu);  // falling through is an edge too
+		return;
+	}
 
-	cpu->operand = cpu->memory[cpu->jmp_addr];
-	cpu->PC += 2;
+	uint16_t end = cpu->reg.PC;
+	cpu->reg.PC = target;
+	cover(cpu);
+	if (target < end)
+		idle_check(cpu, target, end);
 }
 
 
 // INSTRUCTIONS
 // details: https://llx.com/Neil/a2/opcodes.html
 // more: http://www.emulator101.com/reference/6502-reference.html
+// Each takes the effective address from its addressing mode
 
 static uint8_t check_negative(uint8_t value)
 {
@@ -463,35 +965,35 @@ static uint8_t check_carry(uint8_t value)
 }
 
 // group 1
-void ORA(CPU *cpu)
+void ORA(CPU *cpu, uint16_t addr)
 {
-	cpu->A |= cpu->operand;
-	cpu->N = check_negative(cpu->A);
-	cpu->Z = check_zero(cpu->A);
+	cpu->reg.A |= read_byte(cpu, addr);
+	cpu->reg.N = check_negative(cpu->reg.A);
+	cpu->reg.Z = check_zero(cpu->reg.A);
 }
 
-void AND(CPU *cpu)
+void AND(CPU *cpu, uint16_t addr)
 {
-	cpu->A &= cpu->operand;
-	cpu->N = check_negative(cpu->A);
-	cpu->Z = check_zero(cpu->A);
+	cpu->reg.A &= read_byte(cpu, addr);
+	cpu->reg.N = check_negative(cpu->reg.A);
+	cpu->reg.Z = check_zero(cpu->reg.A);
 }
 
-void EOR(CPU *cpu)
+void EOR(CPU *cpu, uint16_t addr)
 {
-	cpu->A ^= cpu->operand;
-	cpu->N = check_negative(cpu->A);
-	cpu->Z = check_zero(cpu->A);
+	cpu->reg.A ^= read_byte(cpu, addr);
+	cpu->reg.N = check_negative(cpu->reg.A);
+	cpu->reg.Z = check_zero(cpu->reg.A);
 }
 
 
 // See details for complicated ADC flag settings here:
 // https://github.com/OneLoneCoder/olcNES/blob/master/Part%232%20-%20CPU/olc6502.cpp#L597
-void ADC(CPU *cpu)
+static void add_with_carry(CPU *cpu, uint8_t operand)
 {
-	uint16_t temp = (uint16_t)cpu->A + (uint16_t)cpu->operand + (uint16_t)cpu->C;
-	cpu->C = temp > 255 ? 1 : 0;
-	cpu->Z = (temp & 0x00FF) == 0 ? 1 : 0;
+	uint16_t temp = (uint16_t)cpu->reg.A + (uint16_t)operand + (uint16_t)cpu->reg.C;
+	cpu->reg.C = temp > 255 ? 1 : 0;
+	cpu->reg.Z = (temp & 0x00FF) == 0 ? 1 : 0;
 
 	/*
 	The over flow is set if the two operands of the addition have the same sign, and the result has the opposite sign
@@ -499,429 +1001,452 @@ void ADC(CPU *cpu)
 	then the overflow flag is set. Notice that the final '&' here will result in 
 	0x80 if this is true on the left-hand side and it will be 0x00 otherwise.
 	*/
-	cpu->V = (~((uint16_t)cpu->A ^ (uint16_t)cpu->operand) & ((uint16_t)cpu->A ^ (uint16_t)temp)) & 0x0080 ? 1 : 0;
-	cpu->N = temp & 0x80 ? 1 : 0;
+	cpu->reg.V = (~((uint16_t)cpu->reg.A ^ (uint16_t)operand) & ((uint16_t)cpu->reg.A ^ (uint16_t)temp)) & 0x0080 ? 1 : 0;
+	cpu->reg.N = temp & 0x80 ? 1 : 0;
 
-	cpu->A = (uint8_t)(temp & 0x00FF);
+	cpu->reg.A = (uint8_t)(temp & 0x00FF);
 }
 
-void STA(CPU *cpu)
+void ADC(CPU *cpu, uint16_t addr)
 {
-	cpu->memory[cpu->jmp_addr] = cpu->A;
+	add_with_carry(cpu, read_byte(cpu, addr));
 }
 
-void LDA(CPU *cpu)
+void STA(CPU *cpu, uint16_t addr)
 {
-	cpu->A = cpu->operand;
-	cpu->Z = check_zero(cpu->A);
-	cpu->N = check_negative(cpu->A);
+	write_byte(cpu, addr, cpu->reg.A);
 }
 
-void CMP(CPU *cpu)
+void LDA(CPU *cpu, uint16_t addr)
 {
-	uint16_t temp = (uint16_t)cpu->A - (uint16_t)cpu->operand;
-	cpu->N = temp & 0x0080 ? 1 : 0;
-	cpu->Z = check_zero(temp & 0x00FF);
-	cpu->C = (cpu->A >= cpu->operand) ? 1 : 0;
+	cpu->reg.A = read_byte(cpu, addr);
+	cpu->reg.Z = check_zero(cpu->reg.A);
+	cpu->reg.N = check_negative(cpu->reg.A);
 }
 
-void SBC(CPU *cpu)
+static void compare(CPU *cpu, uint8_t reg, uint8_t operand)
 {
-	// invert the operand bits, and SBC becomes the same as ADC (i.e. ADC(x) == SBC(~x))
-	cpu->operand ^= 0x00FF;
+	uint16_t temp = (uint16_t)reg - (uint16_t)operand;
+	cpu->reg.N = temp & 0x0080 ? 1 : 0;
+	cpu->reg.Z = check_zero(temp & 0x00FF);
+	cpu->reg.C = (reg >= operand) ? 1 : 0;
+}
 
-	// TODO - determine if this is sufficient
-	ADC(cpu);
+void CMP(CPU *cpu, uint16_t addr)
+{
+	compare(cpu, cpu->reg.A, read_byte(cpu, addr));
+}
+
+void SBC(CPU *cpu, uint16_t addr)
+{
+	// invert the operand bits, and SBC becomes the same as ADC (i.e. ADC(x) == SBC(~x))
+	add_with_carry(cpu, read_byte(cpu, addr) ^ 0xFF);
 }
 
 
 // group 2
-void ASL(CPU *cpu)
+// The shifts and rotates come in two flavours: the accumulator ones (`_A`)
+// never touch memory, the others read and write their target once each
+static uint8_t asl(CPU *cpu, uint8_t value)
 {
-	uint8_t temp = cpu->operand << 1;
-	if (cpu->current_inst->addr_mode == accumulator)
-		cpu->A = temp;
-	else
-		cpu->memory[cpu->jmp_addr] = temp;
-	cpu->C = check_carry(cpu->operand);
-	cpu->N = check_negative(temp);
-	cpu->Z = check_zero(temp);
+	cpu->reg.C = check_carry(value);
+	value <<= 1;
+	cpu->reg.N = check_negative(value);
+	cpu->reg.Z = check_zero(value);
+	return value;
 }
 
-void ROL(CPU *cpu)
+static uint8_t rol(CPU *cpu, uint8_t value)
 {
+	uint8_t temp = (value << 1) + cpu->reg.C;
+	cpu->reg.C = check_carry(value);
+	cpu->reg.N = check_negative(temp);
+	cpu->reg.Z = check_zero(temp);
+	return temp;
+}
 
-	uint8_t temp = (cpu->operand << 1) + cpu->C;
-	cpu->C = check_carry(cpu->operand);
-	if (cpu->current_inst->addr_mode == accumulator)
-		cpu->A = temp;
-	else
-		cpu->memory[cpu->jmp_addr] = temp;
+static uint8_t lsr(CPU *cpu, uint8_t value)
+{
+	cpu->reg.C = value & 0x01 ? 1 : 0;
+	value >>= 1;
+	cpu->reg.N = 0;
+	cpu->reg.Z = check_zero(value);
+	return value;
+}
 
-	cpu->N = check_negative(temp);
-	cpu->Z = check_zero(temp);
-}	
+static uint8_t ror(CPU *cpu, uint8_t value)
+{
+	uint8_t temp = (value >> 1) | (cpu->reg.C << 7);
+	cpu->reg.C = value & 0x01 ? 1 : 0;
+	cpu->reg.N = check_negative(temp);
+	cpu->reg.Z = check_zero(temp);
+	return temp;
+}
 
-void LSR(CPU *cpu)
+void ASL(CPU *cpu, uint16_t addr)
 {
-	uint8_t temp = cpu->operand >> 1;
-	if (cpu->current_inst->addr_mode == accumulator)
-		cpu->A = temp;
-	else
-		cpu->memory[cpu->jmp_addr] = temp;
-	cpu->C = cpu->operand & 0x01 ? 1 : 0;
-	cpu->N = 0;
-	cpu->Z = check_zero(temp);
+	write_byte(cpu, addr, asl(cpu, read_byte(cpu, addr)));
 }
 
-void ROR(CPU *cpu)
+void ROL(CPU *cpu, uint16_t addr)
 {
+	write_byte(cpu, addr, rol(cpu, read_byte(cpu, addr)));
+}
 
-	uint8_t temp = (cpu->operand >> 1) | (cpu->C << 7);
+void LSR(CPU *cpu, uint16_t addr)
+{
+	write_byte(cpu, addr, lsr(cpu, read_byte(cpu, addr)));
+}
 
-	cpu->C = cpu->operand & 0x01 ? 1 : 0;
+void ROR(CPU *cpu, uint16_t addr)
+{
+	write_byte(cpu, addr, ror(cpu, read_byte(cpu, addr)));
+}
 
-	if (cpu->current_inst->addr_mode == accumulator)
-		cpu->A = temp;
-	else
-		cpu->memory[cpu->jmp_addr] = temp;
+void ASL_A(CPU *cpu, uint16_t addr)
+{
+	(void) addr;
+	cpu->reg.A = asl(cpu, cpu->reg.A);
+}
 
-	cpu->N = check_negative(temp);
-	cpu->Z = check_zero(temp);
+void ROL_A(CPU *cpu, uint16_t addr)
+{
+	(void) addr;
+	cpu->reg.A = rol(cpu, cpu->reg.A);
 }
 
-void STX(CPU *cpu)
+void LSR_A(CPU *cpu, uint16_t addr)
 {
-	cpu->memory[cpu->jmp_addr] = cpu->X;
+	(void) addr;
+	cpu->reg.A = lsr(cpu, cpu->reg.A);
 }
 
-void LDX(CPU *cpu)
+void ROR_A(CPU *cpu, uint16_t addr)
 {
-	cpu->X = cpu->operand;
-	cpu->Z = check_zero(cpu->X);
-	cpu->N = check_negative(cpu->X);
+	(void) addr;
+	cpu->reg.A = ror(cpu, cpu->reg.A);
 }
 
-void INC(CPU *cpu)
+void STX(CPU *cpu, uint16_t addr)
 {
-	cpu->operand++;
-	cpu->memory[cpu->jmp_addr] = cpu->operand;
-	cpu->Z = check_zero(cpu->operand);
-	cpu->N = check_negative(cpu->operand);
+	write_byte(cpu, addr, cpu->reg.X);
 }
 
-void DEC(CPU *cpu)
+void LDX(CPU *cpu, uint16_t addr)
 {
-	cpu->operand--;
-	cpu->memory[cpu->jmp_addr] = cpu->operand;
-	cpu->Z = check_zero(cpu->operand);
-	cpu->N = check_negative(cpu->operand);
+	cpu->reg.X = read_byte(cpu, addr);
+	cpu->reg.Z = check_zero(cpu->reg.X);
+	cpu->reg.N = check_negative(cpu->reg.X);
+}
+
+void INC(CPU *cpu, uint16_t addr)
+{
+	uint8_t value = read_byte(cpu, addr) + 1;
+	write_byte(cpu, addr, value);
+	cpu->reg.Z = check_zero(value);
+	cpu->reg.N = check_negative(value);
+}
+
+void DEC(CPU *cpu, uint16_t addr)
+{
+	uint8_t value = read_byte(cpu, addr) - 1;
+	write_byte(cpu, addr, value);
+	cpu->reg.Z = check_zero(value);
+	cpu->reg.N = check_negative(value);
 }
 
 
 // group 3
-void BIT(CPU *cpu)
+void BIT(CPU *cpu, uint16_t addr)
 {
-	printf("%02X %02X\n", cpu->operand, cpu->A);
-	cpu->Z = check_zero((cpu->operand & cpu->A) & 0x00FF);
-	cpu->V = cpu->operand & (1 << 6) ? 1 : 0;
-	cpu->N = cpu->operand & (1 << 7) ? 1 : 0;
+	uint8_t operand = read_byte(cpu, addr);
+	cpu->reg.Z = check_zero(operand & cpu->reg.A);
+	cpu->reg.V = operand & (1 << 6) ? 1 : 0;
+	cpu->reg.N = operand & (1 << 7) ? 1 : 0;
 }
 
-void JMP(CPU *cpu)
+// loop_is_pure turns down any loop closed by an indirect JMP
+void JMP(CPU *cpu, uint16_t addr)
 {
-	cpu->PC = cpu->jmp_addr;
+	uint16_t end = cpu->reg.PC;
+	cpu->reg.PC = addr;
+	cover(cpu);
+	if (addr < end)
+		idle_check(cpu, addr, end);
 }
 
-void STY(CPU *cpu)
+void STY(CPU *cpu, uint16_t addr)
 {
-	cpu->memory[cpu->jmp_addr] = cpu->Y;
+	write_byte(cpu, addr, cpu->reg.Y);
 }
 
-void LDY(CPU *cpu)
+void LDY(CPU *cpu, uint16_t addr)
 {
-	cpu->Y = cpu->operand;
-	cpu->Z = check_zero(cpu->Y);
-	cpu->N = check_negative(cpu->Y);
+	cpu->reg.Y = read_byte(cpu, addr);
+	cpu->reg.Z = check_zero(cpu->reg.Y);
+	cpu->reg.N = check_negative(cpu->reg.Y);
 }
 
-void CPY(CPU *cpu)
+void CPY(CPU *cpu, uint16_t addr)
 {
-	uint16_t temp = (uint16_t)cpu->Y - (uint16_t)cpu->operand;
-	cpu->N = temp & 0x0080 ? 1 : 0;
-	cpu->Z = check_zero(temp & 0x00FF);
-	cpu->C = (cpu->Y >= cpu->operand) ? 1 : 0;
+	compare(cpu, cpu->reg.Y, read_byte(cpu, addr));
 }
 
-void CPX(CPU *cpu)
+void CPX(CPU *cpu, uint16_t addr)
 {
-	uint16_t temp = (uint16_t)cpu->X - (uint16_t)cpu->operand;
-	cpu->N = temp & 0x0080 ? 1 : 0;
-	cpu->Z = check_zero(temp & 0x00FF);
-	cpu->C = (cpu->X >= cpu->operand) ? 1 : 0;
+	compare(cpu, cpu->reg.X, read_byte(cpu, addr));
 }
 
 
 // conditional branches
-void BPL(CPU *cpu)
+void BPL(CPU *cpu, uint16_t addr)
 {
-	if (!cpu->N)
-		cpu->PC += (int8_t)cpu->operand;
+	branch(cpu, !cpu->reg.N, addr);
 }
 
-void BMI(CPU *cpu)
+void BMI(CPU *cpu, uint16_t addr)
 {
-	if (cpu->N)
-		cpu->PC += (int8_t)cpu->operand;
+	branch(cpu, cpu->reg.N, addr);
 }
 
-void BVC(CPU *cpu)
+void BVC(CPU *cpu, uint16_t addr)
 {
-	if (!cpu->V)
-		cpu->PC += (int8_t)cpu->operand;
+	branch(cpu, !cpu->reg.V, addr);
 }
 
-void BVS(CPU *cpu)
+void BVS(CPU *cpu, uint16_t addr)
 {
-	if (cpu->V)
-		cpu->PC += (int8_t)cpu->operand;
+	branch(cpu, cpu->reg.V, addr);
 }
 
-void BCC(CPU *cpu)
+void BCC(CPU *cpu, uint16_t addr)
 {
-	if (!cpu->C)
-		cpu->PC += (int8_t)cpu->operand;
+	branch(cpu, !cpu->reg.C, addr);
 }
 
-void BCS(CPU *cpu)
+void BCS(CPU *cpu, uint16_t addr)
 {
-	if (cpu->C)
-		cpu->PC += (int8_t)cpu->operand;
+	branch(cpu, cpu->reg.C, addr);
 }
 
-void BNE(CPU *cpu)
+void BNE(CPU *cpu, uint16_t addr)
 {
-	if (!cpu->Z)
-		cpu->PC += (int8_t)cpu->operand;
+	branch(cpu, !cpu->reg.Z, addr);
 }
 
-void BEQ(CPU *cpu)
+void BEQ(CPU *cpu, uint16_t addr)
 {
-	if (cpu->Z)
-		cpu->PC += (int8_t)cpu->operand;
+	branch(cpu, cpu->reg.Z, addr);
 }
 
 
 // other
-void BRK(CPU *cpu)
+void BRK(CPU *cpu, uint16_t addr)
 {
-	uint8_t flags = get_flags(cpu);
-	flags |= 1 << 4;
-
-	stack_push_word(cpu, cpu->PC + 1);
-	stack_push(cpu, flags);
-
-	cpu->B = 0;
-
-	cpu->PC = ((uint16_t)cpu->memory[IRQ_LO]) | ((uint16_t)cpu->memory[IRQ_HI] << 8);
+	(void) addr;
+	cpu->reg.PC += 1;  // skip the padding byte
+	cpu->irq_start = cpu->total_cycles - 7;
+	interrupt(cpu, IRQ_LO, 1);
 }
 
-void JSR(CPU *cpu)
+void JSR(CPU *cpu, uint16_t addr)
 {
-	cpu->PC -= 1;
-
-	stack_push_word(cpu, cpu->PC);
+	stack_push_word(cpu, cpu->reg.PC - 1);
 
-	cpu->PC = cpu->jmp_addr;
+	cpu->reg.PC = addr;
+	cover(cpu);
 }
 
-void RTI(CPU *cpu)
+void RTI(CPU *cpu, uint16_t addr)
 {
-	uint8_t B = cpu->B;
+	(void) addr;
+	uint8_t B = cpu->reg.B;
 	set_flags(cpu, stack_pop(cpu));
-	cpu->B = B;
+	cpu->reg.B = B;
+	cpu->irq_mask = cpu->reg.I;  // unlike PLP, RTI's I takes effect at once
+	update_pending(cpu);
 
-	cpu->PC = stack_pop_word(cpu);
+	cpu->reg.PC = stack_pop_word(cpu);
+	cover(cpu);
 }
 
-void RTS(CPU *cpu)
+void RTS(CPU *cpu, uint16_t addr)
 {
-	cpu->PC = stack_pop_word(cpu);
-	cpu->PC++;
+	(void) addr;
+	cpu->reg.PC = stack_pop_word(cpu);
+	cpu->reg.PC++;
+	cover(cpu);
 }
 
-void PHP(CPU *cpu)
+void PHP(CPU *cpu, uint16_t addr)
 {
+	(void) addr;
 	uint8_t flags = get_flags(cpu);
 	flags |= 1 << 4;
 	flags |= 1 << 5;
 	stack_push(cpu, flags);
 }
 
-void PLP(CPU *cpu)
+void PLP(CPU *cpu, uint16_t addr)
 {
-	uint8_t B = cpu->B;
+	(void) addr;
+	uint8_t B = cpu->reg.B;
 	set_flags(cpu, stack_pop(cpu));
-	cpu->B = B;
+	cpu->reg.B = B;
+	cpu->pending |= PENDING_POLL;
 }
 
-void PHA(CPU *cpu)
+void PHA(CPU *cpu, uint16_t addr)
 {
-	stack_push(cpu, cpu->A);
+	(void) addr;
+	stack_push(cpu, cpu->reg.A);
 }
 
-void PLA(CPU *cpu)
+void PLA(CPU *cpu, uint16_t addr)
 {
-	cpu->A = stack_pop(cpu);
-	cpu->Z = check_zero(cpu->A);
-	cpu->N = check_negative(cpu->A);
+	(void) addr;
+	cpu->reg.A = stack_pop(cpu);
+	cpu->reg.Z = check_zero(cpu->reg.A);
+	cpu->reg.N = check_negative(cpu->reg.A);
 }
 
-void DEY(CPU *cpu)
+void DEY(CPU *cpu, uint16_t addr)
 {
-	cpu->Y--;
-	cpu->Z = check_zero(cpu->Y);
-	cpu->N = check_negative(cpu->Y);
+	(void) addr;
+	cpu->reg.Y--;
+	cpu->reg.Z = check_zero(cpu->reg.Y);
+	cpu->reg.N = check_negative(cpu->reg.Y);
 }
 
-void TAY(CPU *cpu)
+void TAY(CPU *cpu, uint16_t addr)
 {
-	cpu->Y = cpu->A;
-	cpu->Z = check_zero(cpu->Y);
-	cpu->N = check_negative(cpu->Y);
+	(void) addr;
+	cpu->reg.Y = cpu->reg.A;
+	cpu->reg.Z = check_zero(cpu->reg.Y);
+	cpu->reg.N = check_negative(cpu->reg.Y);
 }
 
-void INY(CPU *cpu)
+void INY(CPU *cpu, uint16_t addr)
 {
-	cpu->Y++;
-	cpu->Z = check_zero(cpu->Y);
-	cpu->N = check_negative(cpu->Y);
+	(void) addr;
+	cpu->reg.Y++;
+	cpu->reg.Z = check_zero(cpu->reg.Y);
+	cpu->reg.N = check_negative(cpu->reg.Y);
 }
 
-void INX(CPU *cpu)
+void INX(CPU *cpu, uint16_t addr)
 {
-	cpu->X++;
-	cpu->Z = check_zero(cpu->X);
-	cpu->N = check_negative(cpu->X);
+	(void) addr;
+	cpu->reg.X++;
+	cpu->reg.Z = check_zero(cpu->reg.X);
+	cpu->reg.N = check_negative(cpu->reg.X);
 }	
 
-void CLC(CPU *cpu)
+void CLC(CPU *cpu, uint16_t addr)
 {
-	cpu->C = 0;
+	(void) addr;
+	cpu->reg.C = 0;
 }
 
-void SEC(CPU *cpu)
+void SEC(CPU *cpu, uint16_t addr)
 {
-	cpu->C = 1;
+	(void) addr;
+	cpu->reg.C = 1;
 }
 
-void CLI(CPU *cpu)
+void CLI(CPU *cpu, uint16_t addr)
 {
-	cpu->I = 0;
+	(void) addr;
+	cpu->reg.I = 0;
+	cpu->pending |= PENDING_POLL;
 }
 
-void SEI(CPU *cpu)
+void SEI(CPU *cpu, uint16_t addr)
 {
-	cpu->I = 1;
+	(void) addr;
+	cpu->reg.I = 1;
+	cpu->pending |= PENDING_POLL;
 }
 
-void TYA(CPU *cpu)
+void TYA(CPU *cpu, uint16_t addr)
 {
-	cpu->A = cpu->Y;
-	cpu->Z = check_zero(cpu->A);
-	cpu->N = check_negative(cpu->A);
+	(void) addr;
+	cpu->reg.A = cpu->reg.Y;
+	cpu->reg.Z = check_zero(cpu->reg.A);
+	cpu->reg.N = check_negative(cpu->reg.A);
 }
 
-void CLV(CPU *cpu)
+void CLV(CPU *cpu, uint16_t addr)
 {
-	cpu->V = 0;
+	(void) addr;
+	cpu->reg.V = 0;
 }
 
-void CLD(CPU *cpu)
+void CLD(CPU *cpu, uint16_t addr)
 {
-	cpu->D = 0;
+	(void) addr;
+	cpu->reg.D = 0;
 }
 
-void SED(CPU *cpu)
+void SED(CPU *cpu, uint16_t addr)
 {
-	cpu->D = 1;
+	(void) addr;
+	cpu->reg.D = 1;
 }
 
-void TXA(CPU *cpu)
+void TXA(CPU *cpu, uint16_t addr)
 {
-	cpu->A = cpu->X;
-	cpu->Z = check_zero(cpu->X);
-	cpu->N = check_negative(cpu->X);
+	(void) addr;
+	cpu->reg.A = cpu->reg.X;
+	cpu->reg.Z = check_zero(cpu->reg.X);
+	cpu->reg.N = check_negative(cpu->reg.X);
 }
 
-void TXS(CPU *cpu)
+void TXS(CPU *cpu, uint16_t addr)
 {
-	cpu->SP = cpu->X;
+	(void) addr;
+	cpu->reg.SP = cpu->reg.X;
 }
 
-void TAX(CPU *cpu)
+void TAX(CPU *cpu, uint16_t addr)
 {
-	cpu->X = cpu->A;
-	cpu->Z = check_zero(cpu->X);
-	cpu->N = check_negative(cpu->X);
+	(void) addr;
+	cpu->reg.X = cpu->reg.A;
+	cpu->reg.Z = check_zero(cpu->reg.X);
+	cpu->reg.N = check_negative(cpu->reg.X);
 }
 
-void TSX(CPU *cpu)
+void TSX(CPU *cpu, uint16_t addr)
 {
-	cpu->X = cpu->SP;
-	cpu->Z = check_zero(cpu->X);
-	cpu->N = check_negative(cpu->X);
+	(void) addr;
+	cpu->reg.X = cpu->reg.SP;
+	cpu->reg.Z = check_zero(cpu->reg.X);
+	cpu->reg.N = check_negative(cpu->reg.X);
 }
 
-void DEX(CPU *cpu)
+void DEX(CPU *cpu, uint16_t addr)
 {
-	cpu->X--;
-	cpu->Z = check_zero(cpu->X);
-	cpu->N = check_negative(cpu->X);
+	(void) addr;
+	cpu->reg.X--;
+	cpu->reg.Z = check_zero(cpu->reg.X);
+	cpu->reg.N = check_negative(cpu->reg.X);
 }
 
-void NOP(CPU *cpu)
+void NOP(CPU *cpu, uint16_t addr)
 {
 	(void) cpu;
+	(void) addr;
 }
 
-
-// Interrupts
-
-void IMP(CPU *cpu)
+// Undocumented opcodes aren't emulated. Treat them like the KIL/JAM opcodes,
+// which lock the CPU up until reset: PC stays put and nothing else happens
+// before the next event.
+void JAM(CPU *cpu, uint16_t addr)
 {
-	if (cpu->I == 0)
-	{
-		stack_push_word(cpu, cpu->PC);
-
-		cpu->B = 0;
-		cpu->U = 1;
-		cpu->I = 1;
-		stack_push(cpu, get_flags(cpu));
-
-		uint16_t little = cpu->memory[IRQ_LO];
-		uint8_t  big    = cpu->memory[IRQ_HI];
-		cpu->PC = little | (big << 8);
-
-		cpu->current_cycles += 7;
-		cpu->total_cycles   += 7;
-	}
-
+	(void) addr;
+	cpu->reg.PC -= 1;
+	cpu->jammed = 1;
+	if (cpu->next_event > cpu->total_cycles)
+		cpu->total_cycles = cpu->next_event;
 }
 
-void NMI(CPU *cpu)
-{
-		stack_push_word(cpu, cpu->PC);
-
-		cpu->B = 0;
-		cpu->U = 1;
-		cpu->I = 1;
-		stack_push(cpu, get_flags(cpu));
-
-		uint16_t little = cpu->memory[NMI_LO];
-		uint8_t  big    = cpu->memory[NMI_HI];
-		cpu->PC = little | (big << 8);
-
-		cpu->current_cycles += 8;
-		cpu->total_cycles   += 8;
-}
\ No newline at end of file
@@ -2,30 +2,59 @@
 #define _CPU_6502_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 #define BYTES_PER_PAGE 256
 #define PAGES          256
 #define ADDRESS_BYTES  BYTES_PER_PAGE*PAGES
 
+// cpu->pending bits: anything that has to happen between instructions
+#define PENDING_NMI    0x01  // NMI edge latched
+#define PENDING_IRQ    0x02  // an IRQ line is asserted and not masked
+#define PENDING_POLL   0x04  // CLI/SEI/PLP changed I; takes effect after the next poll
+#define PENDING_STOP   0x08  // cpu->stop is set; the run loops return
+
+#define COVERAGE_SIZE  65536  // edge coverage map entries, as in AFL
+
+// cpu->dirty bits: every store sets them all, each consumer clears its own
+#define DIRTY_HASH     0x01  // page_hash is stale
+#define DIRTY_SNAPSHOT 0x02  // differs from the snapshot last taken or restored
+
 
 struct CPU;
+struct Trace;
+struct Perf;
+
+// memory-mapped I/O handlers, called with the full address
+typedef uint8_t (*ReadHandler)(void *, uint16_t);
+typedef void (*WriteHandler)(void *, uint16_t, uint8_t);
+
+// 6510 processor port: called with the levels on the port's pins after a store
+// to $00 (direction) or $01 (data)
+typedef void (*PortHandler)(void *, uint8_t);
+
+// Why the CPU stopped; the run loops return and it stays stopped until reset
+typedef enum StopReason
+{
+	STOP_NONE,
+	STOP_STACK_OVERFLOW,
+	STOP_STACK_UNDERFLOW
+} StopReason;
 
 typedef struct Instruction 
 {
 	char name[3];
-	void (*operation)(struct CPU *);
-	void (*addr_mode)(struct CPU *);
+	void (*operation)(struct CPU *, uint16_t);  // called with the effective address
+	uint16_t (*addr_mode)(struct CPU *);        // advances PC, returns the effective address
 	uint8_t clock_cycles;
 } Instruction;
 
 
-typedef struct CPU
+// Registers, kept together at the front of the CPU so the hot state shares a
+// cache line; each flag is a whole byte so setting one is a plain store
+// described here: https://codebase64.org/doku.php?id=base:6502_registers
+typedef struct Registers
 {
-	// 64 KiB memory (RAM + ROM)
-	uint8_t memory[ADDRESS_BYTES];
-
-	// registers
-	// described here: https://codebase64.org/doku.php?id=base:6502_registers
 	uint16_t PC;         // program counter
 	uint8_t  A;          // accumulator
 	uint8_t  X;          // index register x
@@ -33,26 +62,100 @@ typedef struct CPU
 	uint8_t  SP;         // stack pointer
 
 	// processor flags 
-	unsigned int N : 1;  // 7 negative
-	unsigned int V : 1;  // 6 overflow
-	unsigned int U : 1;  // 5 UNUSED (always set to 1)
-	unsigned int B : 1;  // 4 break
-	unsigned int D : 1;  // 3 decimal mode
-	unsigned int I : 1;  // 2 interrupt disable
-	unsigned int Z : 1;  // 1 zero
-	unsigned int C : 1;  // 0 carry
-
-	// instruction execution
-	Instruction *current_inst;
-	uint8_t  operand;
-	uint16_t jmp_addr;
+	uint8_t  N;          // 7 negative
+	uint8_t  V;          // 6 overflow
+	uint8_t  U;          // 5 UNUSED (always set to 1)
+	uint8_t  B;          // 4 break
+	uint8_t  D;          // 3 decimal mode
+	uint8_t  I;          // 2 interrupt disable
+	uint8_t  Z;          // 1 zero
+	uint8_t  C;          // 0 carry
+} Registers;
+
+// compared and hashed with memcmp, so there must be no padding to differ in
+_Static_assert(sizeof(Registers) == 14, "Registers has padding");
+
+
+// Record of the last backward branch/JMP taken, used to spot idle loops
+typedef struct IdleLoop
+{
+	uint16_t head;       // loop target
+	uint16_t end;        // address just past the branch back to head
+	uint8_t  valid;
+	uint8_t  pure;       // body cannot write memory or touch the stack
+	Registers reg;       // registers when the edge was last taken
+	uint64_t cycles;     // total_cycles when the edge was last taken
+} IdleLoop;
+
+
+typedef struct CPU
+{
+	Registers reg __attribute__((aligned(64)));
 
 	// clock
-	uint8_t  current_cycles;
-	uint32_t total_cycles;
+	uint64_t total_cycles;
+	uint64_t next_event;  // cycle of the next scheduled interrupt/device event (0 = none)
+	uint64_t instructions; // executed, not counting idle iterations skipped
+
+	// memory-mapped I/O, per page; pages without a handler are plain memory
+	ReadHandler  io_read[PAGES];
+	WriteHandler io_write[PAGES];
+	void        *io_data[PAGES];
+	uint8_t      io_scheduled[PAGES];  // reads only change at next_event (or the handler
+	                                   // lowers it), so idle loops may poll the page
+
+	// where each page is read from, when a machine banks ROM over RAM; NULL
+	// reads `memory` as is. Stores always go to `memory` (or an I/O handler).
+	uint8_t **read_map;
+
+	// 6510 on-chip port at $00/$01, when port_handler is set
+	PortHandler port_handler;
+	void       *port_owner;
+	uint8_t     port_ddr;        // 1 bits are outputs
+	uint8_t     port_out;
+
+	// interrupts: devices drive the lines, the loop only tests `pending`
+	uint8_t  pending;     // PENDING_* bits; zero on almost every instruction
+	uint32_t irq_lines;   // asserted IRQ sources, one bit each (wired-OR)
+	uint8_t  nmi_line;    // level of the NMI input, for edge detection
+	uint8_t  irq_mask;    // I as the interrupt poll sees it, one instruction late after CLI/SEI/PLP
+	uint64_t irq_start;   // cycle the last IRQ/BRK sequence began, for NMI hijacking
+
+	IdleLoop idle;
+	uint8_t  jammed;      // hit an opcode we don't emulate
+	StopReason stop;
+
+	// guest edge coverage: control transfers bump coverage[prev ^ target], AFL-style
+	uint8_t  *coverage;   // COVERAGE_SIZE entries, when enabled
+	uint16_t prev_loc;
+
+	// superinstructions (see cpu.c)
+	uint8_t  fusion;        // fuse common sequences when decoding
+	uint8_t  single_step;   // skip the decode cache: one instruction_table lookup each
+	uint64_t fused;         // instructions run inside a superinstruction after its first
+	uint8_t  code_page[PAGES];  // pages holding decoded code; writes there invalidate it
+	uint64_t *pair_counts;  // opcode pair profile, [previous << 8 | next], when enabled
+	uint8_t  last_opcode;
+
+	// incremental state hash (see state.c)
+	uint8_t  dirty[PAGES];       // DIRTY_* bits per page
+	uint64_t page_hash[PAGES];
+	uint64_t memory_hash;        // sum of page_hash
+
+	struct Trace *trace;  // binary execution trace, when enabled
+	struct Perf  *perf;   // host hardware counters, when enabled
+
+	// 64 KiB of RAM (and, without banking, ROM)
+	uint8_t memory[ADDRESS_BYTES];
+
+	// decode state per address: 0 = not decoded yet, 1 = plain instruction,
+	// otherwise a superinstruction starting there
+	uint8_t decoded[ADDRESS_BYTES];
 
 } CPU;
 
+extern Instruction instruction_table[];
+
 CPU *init_cpu();
 void reset_cpu(CPU *);
 void delete_cpu(CPU *);
@@ -66,83 +169,110 @@ uint8_t stack_pop(CPU *);
 void stack_push_word(CPU *, uint16_t);
 uint16_t stack_pop_word(CPU *);
 
+void map_io(CPU *, uint8_t, uint8_t, ReadHandler, WriteHandler, void *);
+void map_reads(CPU *, uint8_t **);
+void map_port(CPU *, PortHandler, void *);
+uint8_t read_byte(CPU *, uint16_t);
+uint8_t peek_banked(CPU *, uint16_t);
+void write_byte(CPU *, uint16_t, uint8_t);
+
 uint8_t *read_file_as_bytes(char *, size_t *);
 void run_program(CPU *, FILE *);
+void run_until(CPU *, uint64_t);
+uint8_t inst_length(Instruction *);
+void invalidate_code(CPU *, uint16_t, uint16_t);
+const char *stop_reason(StopReason);
 
 // Address modes
-void implied(CPU *);
-void accumulator(CPU *);
-void relative(CPU *);
-void immediate(CPU *);
-void indirect(CPU *);
-void zero_page(CPU *);
-void absolute(CPU *);
-void zero_offset_x(CPU *);
-void zero_offset_y(CPU *);
-void abs_offset_x(CPU *);
-void abs_offset_y(CPU *);
-void zero_indirect_x(CPU *);
-void zero_indirect_y(CPU *);
-
-
-void ORA(CPU *);
-void AND(CPU *);
-void EOR(CPU *);
-void ADC(CPU *);
-void STA(CPU *);
-void LDA(CPU *);
-void CMP(CPU *);
-void SBC(CPU *);
-void ASL(CPU *);
-void ROL(CPU *);
-void LSR(CPU *);
-void ROR(CPU *);
-void STX(CPU *);
-void LDX(CPU *);
-void INC(CPU *);
-void DEC(CPU *);
-void BIT(CPU *);
-void JMP(CPU *);
-void STY(CPU *);
-void LDY(CPU *);
-void CPY(CPU *);
-void CPX(CPU *);
-void BPL(CPU *);
-void BMI(CPU *);
-void BVC(CPU *);
-void BVS(CPU *);
-void BCC(CPU *);
-void BCS(CPU *);
-void BNE(CPU *);
-void BEQ(CPU *);
-void BRK(CPU *);
-void JSR(CPU *);
-void RTI(CPU *);
-void RTS(CPU *);
-void PHP(CPU *);
-void PLP(CPU *);
-void PHA(CPU *);
-void PLA(CPU *);
-void DEY(CPU *);
-void TAY(CPU *);
-void INY(CPU *);
-void INX(CPU *);
-void CLC(CPU *);
-void SEC(CPU *);
-void CLI(CPU *);
-void SEI(CPU *);
-void TYA(CPU *);
-void CLV(CPU *);
-void CLD(CPU *);
-void SED(CPU *);
-void TXA(CPU *);
-void TXS(CPU *);
-void TAX(CPU *);
-void TSX(CPU *);
-void DEX(CPU *);
-void NOP(CPU *);
-
-void IMP(CPU *);
-void NMI(CPU *);
+uint16_t implied(CPU *);
+uint16_t accumulator(CPU *);
+uint16_t relative(CPU *);
+uint16_t immediate(CPU *);
+uint16_t indirect(CPU *);
+uint16_t zero_page(CPU *);
+uint16_t absolute(CPU *);
+uint16_t zero_offset_x(CPU *);
+uint16_t zero_offset_y(CPU *);
+uint16_t abs_offset_x(CPU *);
+uint16_t abs_offset_y(CPU *);
+uint16_t zero_indirect_x(CPU *);
+uint16_t zero_indirect_y(CPU *);
+
+
+void ORA(CPU *, uint16_t);
+void AND(CPU *, uint16_t);
+void EOR(CPU *, uint16_t);
+void ADC(CPU *, uint16_t);
+void STA(CPU *, uint16_t);
+void LDA(CPU *, uint16_t);
+void CMP(CPU *, uint16_t);
+void SBC(CPU *, uint16_t);
+void ASL(CPU *, uint16_t);
+void ROL(CPU *, uint16_t);
+void LSR(CPU *, uint16_t);
+void ROR(CPU *, uint16_t);
+void ASL_A(CPU *, uint16_t);
+void ROL_A(CPU *, uint16_t);
+void LSR_A(CPU *, uint16_t);
+void ROR_A(CPU *, uint16_t);
+void STX(CPU *, uint16_t);
+void LDX(CPU *, uint16_t);
+void INC(CPU *, uint16_t);
+void DEC(CPU *, uint16_t);
+void BIT(CPU *, uint16_t);
+void JMP(CPU *, uint16_t);
+void STY(CPU *, uint16_t);
+void LDY(CPU *, uint16_t);
+void CPY(CPU *, uint16_t);
+void CPX(CPU *, uint16_t);
+void BPL(CPU *, uint16_t);
+void BMI(CPU *, uint16_t);
+void BVC(CPU *, uint16_t);
+void BVS(CPU *, uint16_t);
+void BCC(CPU *, uint16_t);
+void BCS(CPU *, uint16_t);
+void BNE(CPU *, uint16_t);
+void BEQ(CPU *, uint16_t);
+void BRK(CPU *, uint16_t);
+void JSR(CPU *, uint16_t);
+void RTI(CPU *, uint16_t);
+void RTS(CPU *, uint16_t);
+void PHP(CPU *, uint16_t);
+void PLP(CPU *, uint16_t);
+void PHA(CPU *, uint16_t);
+void PLA(CPU *, uint16_t);
+void DEY(CPU *, uint16_t);
+void TAY(CPU *, uint16_t);
+void INY(CPU *, uint16_t);
+void INX(CPU *, uint16_t);
+void CLC(CPU *, uint16_t);
+void SEC(CPU *, uint16_t);
+void CLI(CPU *, uint16_t);
+void SEI(CPU *, uint16_t);
+void TYA(CPU *, uint16_t);
+void CLV(CPU *, uint16_t);
+void CLD(CPU *, uint16_t);
+void SED(CPU *, uint16_t);
+void TXA(CPU *, uint16_t);
+void TXS(CPU *, uint16_t);
+void TAX(CPU *, uint16_t);
+void TSX(CPU *, uint16_t);
+void DEX(CPU *, uint16_t);
+void NOP(CPU *, uint16_t);
+void JAM(CPU *, uint16_t);
+
+// Interrupt lines
+void irq_assert(CPU *, uint32_t);
+void irq_release(CPU *, uint32_t);
+void nmi_set(CPU *, uint8_t, uint64_t);
+
+// A byte as the CPU sees it, without I/O side effects: instruction fetches,
+// vectors and pointers
+static inline uint8_t peek(CPU *cpu, uint16_t addr)
+{
+	if (__builtin_expect(cpu->read_map != NULL, 0))
+		return peek_banked(cpu, addr);
+	return cpu->memory[addr];
+}
 
 #endif
\ No newline at end of file
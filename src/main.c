@@ -0,0 +1,255 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "cpu.h"
+#include "nes.h"
+#include "trace.h"
+#include "perf.h"
+#include "pace.h"
+#include "render.h"
+
+#define PROFILE_PAIRS  20
+#define AUDIO_TARGET   (SAMPLE_RATE / 15)  // 4 frames of queued audio when slaved
+
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-n frames] [-p] [-e entry] [-t trace.bin] [-s screenshot.ppm] [-w audio.wav] [-c] [-f] [-P] [-r] [-a] [-R frames] [-T] [rom]\n", prog);
+	fprintf(stderr, "  -n frames  number of frames to run (default 600)\n");
+	fprintf(stderr, "  -p         PAL timing (default NTSC)\n");
+	fprintf(stderr, "  -e entry   start at this hex address instead of the reset vector\n");
+	fprintf(stderr, "  -t file    write a binary trace of every instruction (see trace2log)\n");
+	fprintf(stderr, "  -s file    save the last frame as a PPM image\n");
+	fprintf(stderr, "  -w file    write the audio as a 48 kHz WAV file\n");
+	fprintf(stderr, "  -c         report host hardware counters per guest instruction\n");
+	fprintf(stderr, "  -f         don't fuse common instruction sequences into superinstructions\n");
+	fprintf(stderr, "  -P         profile opcode pairs and print the most common ones\n");
+	fprintf(stderr, "  -r         run at real hardware speed\n");
+	fprintf(stderr, "  -a         with -r, slave the speed to how full the -w pipe is\n");
+	fprintf(stderr, "  -R frames  run ahead: show the frame this many frames later, then rewind\n");
+	fprintf(stderr, "  -T         draw frames on a second thread while the CPU runs the next one\n");
+	exit(EXIT_FAILURE);
+}
+
+// The most frequent opcode pairs, the candidates for superinstructions
+static void print_pairs(uint64_t *pair_counts, FILE *f)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < 0x10000; i++)
+		total += pair_counts[i];
+
+	fprintf(f, "top opcode pairs of %lu:\n", (unsigned long)total);
+	for (int n = 0; n < PROFILE_PAIRS && total; n++)
+	{
+		int best = 0;
+		for (int i = 1; i < 0x10000; i++)
+			if (pair_counts[i] > pair_counts[best])
+				best = i;
+		if (!pair_counts[best])
+			break;
+
+		Instruction *first = &instruction_table[best >> 8], *second = &instruction_table[best & 0xFF];
+		fprintf(f, "  %02X %.3s / %02X %.3s  %10lu  %5.2f%%\n", best >> 8, first->name, best & 0xFF,
+		        second->name, (unsigned long)pair_counts[best], 100.0 * pair_counts[best] / total);
+		pair_counts[best] = 0;
+	}
+}
+
+// Samples queued in the audio pipe and not yet played, or -1 if it isn't a pipe
+static long audio_fill(FILE *wav)
+{
+	int bytes;
+	fflush(wav);
+	if (ioctl(fileno(wav), FIONREAD, &bytes) != 0)
+		return -1;
+	return bytes / 2;
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	char *fname = "nestest.nes";
+	Region region = NTSC;
+	long frames = 600;
+	long entry = -1;
+	char *trace_name = NULL;
+	FILE *trace_file = NULL;
+	char *screenshot = NULL;
+	char *wav_name = NULL;
+	FILE *wav = NULL;
+	int counters = 0;
+	int pipelined = 0;
+	int fusion = 1;
+	int realtime = 0, slave_audio = 0;
+	long run_ahead = 0;
+	NesState *ahead = NULL;
+	uint64_t ahead_ns = 0;
+	Pacer pacer;
+	uint64_t *pair_counts = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:pe:t:s:w:cfPraR:T")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n': frames = strtol(optarg, NULL, 10); break;
+			case 'p': region = PAL; break;
+			case 'e': entry = strtol(optarg, NULL, 16); break;
+			case 't': trace_name = optarg; break;
+			case 's': screenshot = optarg; break;
+			case 'w': wav_name = optarg; break;
+			case 'c': counters = 1; break;
+			case 'f': fusion = 0; break;
+			case 'P': pair_counts = calloc(0x10000, sizeof(uint64_t)); break;
+			case 'r': realtime = 1; break;
+			case 'a': slave_audio = 1; break;
+			case 'R': run_ahead = strtol(optarg, NULL, 10); break;
+			case 'T': pipelined = 1; break;
+			default:  usage(argv[0]);
+		}
+	}
+	if (optind < argc)
+		fname = argv[optind];
+
+	NES *nes = init_nes(region);
+	load_ines(nes, fname);
+	if (entry >= 0)
+		nes->cpu->reg.PC = (uint16_t)entry;
+	nes->cpu->fusion = fusion;
+	nes->cpu->pair_counts = pair_counts;
+
+	if (trace_name)
+	{
+		trace_file = fopen(trace_name, "wb");
+		if (trace_file == NULL)
+		{
+			perror("fopen trace");
+			exit(EXIT_FAILURE);
+		}
+		nes->cpu->trace = trace_open(trace_file);
+	}
+	if (wav_name)
+		wav = wav_open(wav_name, SAMPLE_RATE);
+	if (counters)
+	{
+		nes_attach_perf(nes, perf_open());
+		if (nes->cpu->perf == NULL)
+			fprintf(stderr, "[WARNING] perf_event_open counters unavailable; running without them\n");
+	}
+
+	if (pipelined && render_open(nes) == NULL)
+	{
+		fprintf(stderr, "[WARNING] Could not start the render thread; rendering synchronously\n");
+		pipelined = 0;
+	}
+	if (run_ahead > 0 && trace_name)
+	{
+		fprintf(stderr, "[WARNING] -R would trace the rewound frames too; running without run-ahead\n");
+		run_ahead = 0;
+	}
+	if (run_ahead > 0)
+		ahead = calloc(1, sizeof(NesState));
+
+	if (slave_audio && (!wav || audio_fill(wav) < 0))
+	{
+		fprintf(stderr, "[WARNING] -a needs -w writing to a pipe; pacing to the host clock\n");
+		slave_audio = 0;
+	}
+	pace_init(&pacer, (uint64_t)nes->scanlines * DOTS_PER_LINE * nes->master_per_dot, nes->master_hz,
+	          SAMPLE_RATE, slave_audio ? AUDIO_TARGET : 0);
+
+	double start = seconds();
+	for (long i = 0; i < frames; i++)
+	{
+		run_frame(nes);
+		if (nes->cpu->stop)
+		{
+			fprintf(stderr, "[ERROR] %s at $%04X; exiting...", stop_reason(nes->cpu->stop), nes->cpu->reg.PC);
+			exit(EXIT_FAILURE);
+		}
+		if (wav)
+			wav_write(wav, nes->apu.samples, nes->apu.sample_count);
+		nes->apu.sample_count = 0;
+
+		// what's shown is the frame run_ahead frames on, whose audio is dropped
+		// when the machine is rewound to where the real frame left it
+		if (ahead)
+		{
+			double before = seconds();
+			save_nes(nes, ahead);
+			double saved = seconds();
+			for (long j = 0; j < run_ahead; j++)
+				run_frame(nes);
+			double ran = seconds();
+			restore_nes(nes, ahead);
+			ahead_ns += (uint64_t)((saved - before + seconds() - ran) * 1e9);
+		}
+
+		if (realtime)
+			pace_frame(&pacer, slave_audio ? audio_fill(wav) : -1);
+	}
+	uint64_t stalls = 0;
+	if (nes->renderer)
+	{
+		stalls = nes->renderer->stalls;
+		render_close(nes);
+	}
+	double elapsed = seconds() - start;
+
+	if (wav)
+		wav_close(wav);
+	if (trace_file)
+	{
+		trace_close(nes->cpu->trace);
+		nes->cpu->trace = NULL;
+		fclose(trace_file);
+	}
+
+	if (screenshot)
+		ppu_write_ppm(&nes->ppu, screenshot);
+
+	printf("%lu frames, %lu cycles in %.3f s: %.1f frames/s (%.1fx real time)\n",
+	       (unsigned long)nes->frame_count, (unsigned long)nes->cpu->total_cycles, elapsed,
+	       frames / elapsed, frames / elapsed / (region == PAL ? 50.007 : 60.099));
+	printf("audio synthesis: %.1f%% of frame time\n", nes->audio_ns / 1e9 / elapsed * 100);
+	printf("%lu guest instructions: %.1f M/s, %.1f%% fused into superinstructions\n",
+	       (unsigned long)nes->cpu->instructions, nes->cpu->instructions / elapsed / 1e6,
+	       nes->cpu->instructions ? 100.0 * nes->cpu->fused / nes->cpu->instructions : 0.0);
+	if (pipelined)
+		printf("render thread: CPU thread waited for it %lu times\n", (unsigned long)stalls);
+	if (ahead)
+	{
+		printf("run-ahead %ld: %.1f us per save + restore\n", run_ahead, ahead_ns / 1e3 / frames);
+		free(ahead);
+	}
+	if (realtime)
+	{
+		struct timespec cpu_time;
+		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_time);
+		pace_report(&pacer, stdout);
+		printf("host CPU: %.1f%% of one core\n", (cpu_time.tv_sec + cpu_time.tv_nsec / 1e9) / elapsed * 100);
+	}
+	if (pair_counts)
+	{
+		print_pairs(pair_counts, stdout);
+		free(pair_counts);
+	}
+	if (nes->cpu->perf)
+	{
+		perf_report(nes->cpu->perf, stdout);
+		perf_close(nes->cpu->perf);
+	}
+
+	delete_nes(nes);
+	return 0;
+}
@@ -0,0 +1,373 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "nes.h"
+#include "perf.h"
+#include "render.h"
+
+#define INES_HEADER    16
+#define INES_TRAINER   512
+#define PRG_BANK       0x4000
+#define OAMDMA         0x4014
+#define APUSTATUS      0x4015
+#define JOYPAD2        0x4017
+#define NTSC_MASTER_HZ 21477272
+#define PAL_MASTER_HZ  26601712
+#define VISIBLE_DOTS   257  // a line's pixels are done by this dot
+
+
+// Nominal CPU cycles per frame, rounded down (29780.67 on NTSC); the
+// fraction carries over from frame to frame
+uint64_t frame_cycles(NES *nes)
+{
+	return (uint64_t)nes->scanlines * DOTS_PER_LINE * nes->master_per_dot / nes->master_per_cpu;
+}
+
+// First CPU cycle at or after the given dot of the current frame
+static uint64_t dot_cycle(NES *nes, uint32_t line, uint32_t dot)
+{
+	uint64_t master = nes->master_clock + ((uint64_t)line * DOTS_PER_LINE + dot) * nes->master_per_dot;
+	return (master + nes->master_per_cpu - 1) / nes->master_per_cpu;
+}
+
+// Frame position of the current CPU cycle
+static void frame_position(NES *nes, uint32_t *line, uint32_t *dot)
+{
+	uint64_t master = nes->cpu->total_cycles * nes->master_per_cpu;
+	uint64_t dots = master > nes->master_clock ? (master - nes->master_clock) / nes->master_per_dot : 0;
+
+	*line = dots / DOTS_PER_LINE;
+	*dot = dots % DOTS_PER_LINE;
+}
+
+// Render every line the real PPU would have finished by now. Returns the
+// first line that isn't finished yet.
+static uint32_t catch_up(NES *nes)
+{
+	uint32_t line, dot;
+	frame_position(nes, &line, &dot);
+	if (dot >= VISIBLE_DOTS)
+		line++;
+	ppu_render_to(&nes->ppu, line);
+	return line;
+}
+
+
+// Interrupt outputs: the PPU pulls NMI low while in vblank with NMI enabled; the
+// APU's frame counter and DMC each hold an IRQ line until acknowledged
+static void update_nmi(NES *nes, uint64_t cycle)
+{
+	nmi_set(nes->cpu, (nes->ppu.status & nes->ppu.ctrl & 0x80) != 0, cycle);
+}
+
+static void update_irq(NES *nes)
+{
+	if (nes->apu.frame_irq)
+		irq_assert(nes->cpu, IRQ_APU_FRAME);
+	else
+		irq_release(nes->cpu, IRQ_APU_FRAME);
+
+	if (nes->apu.dmc.irq)
+		irq_assert(nes->cpu, IRQ_APU_DMC);
+	else
+		irq_release(nes->cpu, IRQ_APU_DMC);
+}
+
+
+// I/O HANDLERS
+// PPU registers are mirrored every 8 bytes through 0x2000-0x3FFF
+
+static uint8_t ppu_io_read(void *data, uint16_t addr)
+{
+	NES *nes = data;
+	PPU *ppu = &nes->ppu;
+	uint8_t reg = addr & 0x07;
+
+	if (reg == 2)
+	{
+		// sprite 0 hit can appear on the next line without any event, so idle
+		// loops polling for it may only be skipped that far
+		uint32_t line = catch_up(nes);
+		uint64_t next_line = dot_cycle(nes, line, VISIBLE_DOTS);
+		if (line < SCREEN_HEIGHT && ppu_rendering(ppu) && !(ppu->status & 0x40) && nes->cpu->next_event > next_line)
+			nes->cpu->next_event = next_line;
+	}
+	else if (reg == 7)
+	{
+		// every read moves the VRAM address, which the lines before it must not see
+		catch_up(nes);
+		nes->cpu->idle.valid = 0;
+	}
+
+	uint8_t value = ppu_read(ppu, reg);
+	if (nes->renderer)
+		render_log(nes->renderer, ppu->line, reg | RENDER_READ, 0);
+	if (reg == 2)
+		update_nmi(nes, nes->cpu->total_cycles);  // reading clears vblank
+	return value;
+}
+
+static void ppu_io_write(void *data, uint16_t addr, uint8_t value)
+{
+	NES *nes = data;
+	PPU *ppu = &nes->ppu;
+	uint8_t reg = addr & 0x07;
+
+	catch_up(nes);
+	ppu_write(ppu, reg, value);
+	if (nes->renderer)
+		render_log(nes->renderer, ppu->line, reg, value);
+
+	// enabling NMI during vblank fires it straight away
+	if (reg == 0)
+		update_nmi(nes, nes->cpu->total_cycles);
+}
+
+// 0x4000-0x4017: APU and I/O registers; the rest of the page is plain memory
+static uint8_t apu_io_read(void *data, uint16_t addr)
+{
+	NES *nes = data;
+
+	if (addr == APUSTATUS)
+	{
+		uint8_t status = apu_read_status(&nes->apu, nes->cpu->total_cycles);
+		update_irq(nes);  // acknowledges the frame IRQ
+		return status;
+	}
+	return nes->cpu->memory[addr];
+}
+
+static void apu_io_write(void *data, uint16_t addr, uint8_t value)
+{
+	NES *nes = data;
+	CPU *cpu = nes->cpu;
+
+	if (addr < OAMDMA || addr == APUSTATUS || addr == JOYPAD2)
+	{
+		apu_write(&nes->apu, cpu->total_cycles, addr, value);
+		// $4015 acknowledges the DMC IRQ, $4017 can inhibit the frame IRQ
+		if (addr == APUSTATUS || addr == JOYPAD2)
+			update_irq(nes);
+		// a restarted sample or frame counter can fire sooner than the slice
+		// was meant to run
+		uint64_t next = apu_next_irq(&nes->apu);
+		if (next < cpu->next_event)
+			cpu->next_event = next;
+		return;
+	}
+	if (addr != OAMDMA)
+	{
+		cpu->memory[addr] = value;
+		return;
+	}
+
+	// copy a page into OAM; the CPU is stalled for 513 or 514 cycles
+	catch_up(nes);
+	for (int i = 0; i < 256; i++)
+	{
+		uint8_t byte = read_byte(cpu, (uint16_t)value << 8 | i);
+		nes->ppu.oam[(uint8_t)(nes->ppu.oam_addr + i)] = byte;
+		if (nes->renderer)
+			render_log(nes->renderer, nes->ppu.line, 4, byte);  // same as a $2004 write
+	}
+	cpu->total_cycles += 513 + (cpu->total_cycles & 1);
+}
+
+
+NES *init_nes(Region region)
+{
+	NES *nes = calloc(1, sizeof(NES));
+	nes->cpu = init_cpu();
+	nes->region = region;
+
+	if (region == PAL)
+	{
+		nes->master_per_cpu = 16;
+		nes->master_per_dot = 5;
+		nes->scanlines = 312;
+		nes->master_hz = PAL_MASTER_HZ;
+	}
+	else
+	{
+		nes->master_per_cpu = 12;
+		nes->master_per_dot = 4;
+		nes->scanlines = 262;
+		nes->master_hz = NTSC_MASTER_HZ;
+	}
+
+	// the CPU and master clocks share an origin
+	nes->master_clock = nes->cpu->total_cycles * nes->master_per_cpu;
+
+	reset_apu(&nes->apu, nes->cpu->memory, nes->master_hz,
+	          nes->master_per_cpu, region == PAL, SAMPLE_RATE);
+
+	map_io(nes->cpu, 0x20, 0x3F, ppu_io_read, ppu_io_write, nes);
+	// $2002 polling sees vblank at a frame event and sprite 0 hit no sooner than
+	// the next line, which its handler schedules; the APU page has neither
+	memset(&nes->cpu->io_scheduled[0x20], 1, 0x3F - 0x20 + 1);
+	map_io(nes->cpu, 0x40, 0x40, apu_io_read, apu_io_write, nes);
+	return nes;
+}
+
+void delete_nes(NES *nes)
+{
+	if (nes->renderer)
+		render_close(nes);
+	delete_cpu(nes->cpu);
+	free(nes->chr);
+	free(nes);
+}
+
+// iNES format: https://www.nesdev.org/wiki/INES
+void load_ines(NES *nes, char *file_name)
+{
+	size_t file_len;
+	uint8_t *bytes = read_file_as_bytes(file_name, &file_len);
+
+	if (file_len < INES_HEADER || memcmp(bytes, "NES\x1A", 4) != 0)
+	{
+		fprintf(stderr, "[ERROR] %s is not an iNES file; exiting...", file_name);
+		exit(EXIT_FAILURE);
+	}
+
+	size_t prg_size = bytes[4] * PRG_BANK;
+	size_t chr_size = bytes[5] * CHR_BANK;
+	uint8_t mapper = (bytes[6] >> 4) | (bytes[7] & 0xF0);
+	size_t offset = INES_HEADER + (bytes[6] & 0x04 ? INES_TRAINER : 0);
+
+	if (mapper != 0 || prg_size == 0 || prg_size > 2 * PRG_BANK)
+	{
+		fprintf(stderr, "[ERROR] Only NROM (mapper 0) cartridges are supported; exiting...");
+		exit(EXIT_FAILURE);
+	}
+	if (offset + prg_size + chr_size > file_len)
+	{
+		fprintf(stderr, "[ERROR] %s is truncated; exiting...", file_name);
+		exit(EXIT_FAILURE);
+	}
+
+	// 16 KiB carts are mirrored into both halves of 0x8000-0xFFFF
+	CPU *cpu = nes->cpu;
+	memcpy(&cpu->memory[0x8000], bytes + offset, prg_size);
+	if (prg_size == PRG_BANK)
+		memcpy(&cpu->memory[0xC000], bytes + offset, PRG_BANK);
+
+	// carts without CHR ROM have 8 KiB of CHR RAM instead
+	free(nes->chr);
+	nes->chr_size = chr_size;
+	nes->chr = calloc(1, chr_size ? chr_size : CHR_BANK);
+	memcpy(nes->chr, bytes + offset + prg_size, chr_size);
+	reset_ppu(&nes->ppu, nes->chr, chr_size == 0, bytes[6] & 0x01 ? VERTICAL : HORIZONTAL);
+
+	cpu->reg.PC = (uint16_t)cpu->memory[0xFFFD] << 8 | cpu->memory[0xFFFC];
+	free(bytes);
+}
+
+// Run the CPU up to a PPU event, stopping to raise the frame counter's and the
+// DMC's IRQs on the way. A slice can end early, and an APU write in it can move
+// or cancel the IRQ it was aimed at, so each is only raised if still due there.
+static void run_to(NES *nes, uint64_t cycle)
+{
+	CPU *cpu = nes->cpu;
+	APU *apu = &nes->apu;
+
+	while (cpu->total_cycles < cycle && !(cpu->pending & PENDING_STOP))
+	{
+		uint64_t at = apu_next_irq(apu);
+		run_until(cpu, at < cycle ? at : cycle);
+		if (cpu->total_cycles < at)
+			continue;
+		if (apu->next_irq == at)
+			apu_frame_irq(apu, at);
+		if (apu->next_dmc_irq == at)
+			apu_run(apu, at);  // reaches the last fetch, which sets dmc.irq
+		update_irq(nes);
+	}
+}
+
+// Count host events per frame and for audio synthesis; NULL detaches
+void nes_attach_perf(NES *nes, Perf *perf)
+{
+	nes->cpu->perf = perf;
+	nes->perf_frame = perf ? perf_phase(perf, "frame") : NULL;
+	nes->perf_audio = perf ? perf_phase(perf, "audio") : NULL;
+}
+
+// Run one frame, from scanline 0 to the end of the pre-render line. The CPU runs
+// in a tight loop between the two events of the frame, the start and end of
+// vblank, with no per-instruction polling; the PPU renders lazily, catching up
+// whenever the CPU touches its registers and at vblank. When pipelined, those
+// lines only track state here, and the frame's PPU accesses go to the render
+// thread at vblank to be drawn while the CPU runs on.
+void run_frame(NES *nes)
+{
+	CPU *cpu = nes->cpu;
+	PPU *ppu = &nes->ppu;
+	PerfPhase *frame = nes->perf_frame, *audio = nes->perf_audio;
+
+	if (frame)
+		perf_begin(cpu->perf, frame, cpu->instructions);
+
+	ppu_begin_frame(ppu);
+	if (nes->renderer)
+		render_begin(nes->renderer, ppu);
+
+	run_to(nes, dot_cycle(nes, VBLANK_LINE, 1));
+	ppu_render_to(ppu, SCREEN_HEIGHT);
+	if (nes->renderer)
+		render_publish(nes->renderer);
+	ppu->status |= 0x80;
+	update_nmi(nes, dot_cycle(nes, VBLANK_LINE, 1));
+
+	run_to(nes, dot_cycle(nes, nes->scanlines - 1, 1));
+	ppu->status &= ~0xE0;
+	update_nmi(nes, cpu->total_cycles);
+
+	run_to(nes, dot_cycle(nes, nes->scanlines, 0));
+
+	// the whole frame's audio is synthesized in one pass
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (audio)
+		perf_begin(cpu->perf, audio, frame->guest_start);  // charged to the frame's instructions
+	apu_end_frame(&nes->apu, cpu->total_cycles);
+	update_irq(nes);  // the DMC may have finished during the frame
+	if (audio)
+		perf_end(cpu->perf, audio, cpu->instructions);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	nes->audio_ns += (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+
+	nes->master_clock += (uint64_t)nes->scanlines * DOTS_PER_LINE * nes->master_per_dot;
+	nes->frame_count++;
+
+	if (frame)
+		perf_end(cpu->perf, frame, cpu->instructions);
+}
+
+
+// Capture and rewind the whole machine. Cheap enough to do every frame: the CPU
+// copies only the pages written since the last take, and the rest is ~50 KiB.
+void save_nes(NES *nes, NesState *state)
+{
+	snapshot_take(nes->cpu, &state->cpu);
+	memcpy(state->ppu, &nes->ppu, sizeof(state->ppu));
+	state->apu = nes->apu;
+	if (nes->ppu.chr_writable)
+		memcpy(state->chr_ram, nes->chr, CHR_BANK);
+	state->master_clock = nes->master_clock;
+	state->frame_count = nes->frame_count;
+}
+
+// The state must have been saved from this NES
+void restore_nes(NES *nes, NesState *state)
+{
+	snapshot_restore(nes->cpu, &state->cpu);
+	memcpy(&nes->ppu, state->ppu, sizeof(state->ppu));
+	nes->apu = state->apu;
+	if (nes->ppu.chr_writable)
+		memcpy(nes->chr, state->chr_ram, CHR_BANK);
+	nes->master_clock = state->master_clock;
+	nes->frame_count = state->frame_count;
+}
@@ -0,0 +1,77 @@
+#ifndef _NES_H
+#define _NES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu.h"
+#include "ppu.h"
+#include "apu.h"
+#include "state.h"
+
+#define DOTS_PER_LINE  341
+#define VBLANK_LINE    241
+#define SAMPLE_RATE    48000
+#define CHR_BANK       0x2000
+
+// the NES's IRQ sources, one CPU line each
+#define IRQ_APU_FRAME  (1 << 0)
+#define IRQ_APU_DMC    (1 << 1)
+
+typedef enum Region
+{
+	NTSC,
+	PAL
+} Region;
+
+
+typedef struct NES
+{
+	CPU *cpu;
+	PPU ppu;
+	APU apu;
+	Region region;
+
+	// cartridge (mapper 0 only)
+	uint8_t *chr;
+	size_t   chr_size;
+
+	// timing: the 2A03 and PPU both divide a master clock
+	// NTSC: 21.477 MHz, CPU /12, PPU /4, 262 lines
+	// PAL:  26.602 MHz, CPU /16, PPU /5, 312 lines
+	uint32_t master_per_cpu;
+	uint32_t master_per_dot;
+	uint32_t scanlines;
+	uint64_t master_hz;
+	uint64_t master_clock;  // master clock at the start of the current frame
+	uint64_t frame_count;
+	uint64_t audio_ns;      // host time spent synthesizing audio
+
+	struct Renderer *renderer;  // render thread, when pipelined
+
+	// host counter phases, looked up once by nes_attach_perf
+	struct PerfPhase *perf_frame;
+	struct PerfPhase *perf_audio;
+} NES;
+
+// Everything a frame can change, for run-ahead. The CPU part is an incremental
+// Snapshot; the PPU's framebuffer is output rather than state and isn't kept.
+typedef struct NesState
+{
+	Snapshot cpu;
+	uint8_t  ppu[offsetof(PPU, framebuffer)];
+	APU      apu;
+	uint8_t  chr_ram[CHR_BANK];  // only when the cart has CHR RAM
+	uint64_t master_clock;
+	uint64_t frame_count;
+} NesState;
+
+NES *init_nes(Region);
+void delete_nes(NES *);
+void load_ines(NES *, char *);
+void run_frame(NES *);
+void nes_attach_perf(NES *, struct Perf *);
+uint64_t frame_cycles(NES *);
+void save_nes(NES *, NesState *);
+void restore_nes(NES *, NesState *);
+
+#endif
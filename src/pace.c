@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "pace.h"
+
+#define NS_PER_SEC     1000000000ULL
+#define AUDIO_GAIN     0.05   // fraction of the fill error corrected per frame
+
+
+static int64_t ts_ns(struct timespec ts)
+{
+	return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static struct timespec ns_ts(int64_t ns)
+{
+	return (struct timespec){ns / NS_PER_SEC, ns % NS_PER_SEC};
+}
+
+// `ticks_per_frame` master clock ticks at `master_hz` make one frame; a
+// `target` above zero is the audio buffer fill, in samples, to slave to
+void pace_init(Pacer *p, uint64_t ticks_per_frame, uint64_t master_hz, uint32_t sample_rate, long target)
+{
+	memset(p, 0, sizeof(Pacer));
+	p->ticks_per_frame = ticks_per_frame;
+	p->master_hz = master_hz;
+	p->sample_rate = sample_rate;
+	p->target = target;
+	clock_gettime(CLOCK_MONOTONIC, &p->origin);
+}
+
+// Deadline of frame n, relative to the origin
+static int64_t frame_ns(Pacer *p, uint64_t n)
+{
+	uint64_t ticks = n * p->ticks_per_frame;
+	return ticks / p->master_hz * NS_PER_SEC + ticks % p->master_hz * NS_PER_SEC / p->master_hz;
+}
+
+static void record(Pacer *p, int64_t late_ns)
+{
+	uint64_t late = late_ns > 0 ? (uint64_t)late_ns : 0;
+	int bucket = 0;
+
+	while (bucket < PACE_BUCKETS - 1 && late >= 1000ULL << bucket)
+		bucket++;
+	p->late[bucket]++;
+	if (late > p->max_late_ns)
+		p->max_late_ns = late;
+}
+
+// Call once a frame has been emulated: sleeps until it is due. `fill` is the
+// number of samples still queued in the audio output, or negative if unknown.
+void pace_frame(Pacer *p, long fill)
+{
+	p->frames++;
+
+	// a fuller buffer than wanted means we run ahead of the audio clock:
+	// move the schedule later by part of the surplus, and earlier for a deficit
+	if (p->target > 0 && fill >= 0)
+	{
+		int64_t error_ns = (int64_t)(fill - p->target) * (int64_t)NS_PER_SEC / p->sample_rate;
+		p->origin = ns_ts(ts_ns(p->origin) + (int64_t)(error_ns * AUDIO_GAIN));
+	}
+
+	int64_t deadline = ts_ns(p->origin) + frame_ns(p, p->frames);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// too far behind (stalled, suspended): start over from now rather than race to catch up
+	if (ts_ns(now) - deadline > frame_ns(p, PACE_MAX_LATE))
+	{
+		p->origin = ns_ts(ts_ns(now) - frame_ns(p, p->frames));
+		p->rebases++;
+		return;
+	}
+
+	struct timespec due = ns_ts(deadline);
+	int err;
+	while ((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)) == EINTR)
+		;  // interrupted by a signal
+	if (err)
+	{
+		fprintf(stderr, "[WARNING] clock_nanosleep: %s; frame %" PRIu64 " not paced\n", strerror(err), p->frames);
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record(p, ts_ns(now) - deadline);
+}
+
+void pace_report(Pacer *p, FILE *f)
+{
+	uint64_t total = 0;
+	for (int i = 0; i < PACE_BUCKETS; i++)
+		total += p->late[i];
+	if (!total)
+		return;
+
+	fprintf(f, "pacing: %" PRIu64 " frames, wake-up lateness (max %.1f us, %" PRIu64 " rebases):\n",
+	        p->frames, p->max_late_ns / 1e3, p->rebases);
+	for (int i = 0; i < PACE_BUCKETS; i++)
+	{
+		if (!p->late[i])
+			continue;
+		if (i == PACE_BUCKETS - 1)
+			fprintf(f, "  >= %6llu us", 1ULL << (i - 1));
+		else
+			fprintf(f, "  <  %6llu us", 1ULL << i);
+		fprintf(f, " %8" PRIu64 " %5.1f%% ", p->late[i], 100.0 * p->late[i] / total);
+		for (int bar = 0; bar < (int)(50 * p->late[i] / total); bar++)
+			fputc('#', f);
+		fputc('\n', f);
+	}
+}
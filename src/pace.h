@@ -0,0 +1,34 @@
+#ifndef _PACE_H
+#define _PACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define PACE_BUCKETS   18   // lateness histogram: < 1 us, < 2 us, ... < 65.5 ms, more
+#define PACE_MAX_LATE  4    // frames behind before the schedule is rebased
+
+
+// Real-time pacing: frame n is due at origin + n * period, computed exactly
+// from the master clock, so rounding never accumulates into drift
+typedef struct Pacer
+{
+	uint64_t ticks_per_frame;  // master clock ticks
+	uint64_t master_hz;
+	struct timespec origin;
+	uint64_t frames;
+
+	// audio slaving: the origin is nudged to hold the output buffer at `target`
+	uint32_t sample_rate;
+	long     target;           // samples
+
+	uint64_t late[PACE_BUCKETS];  // wake-up lateness histogram
+	uint64_t max_late_ns;
+	uint64_t rebases;
+} Pacer;
+
+void pace_init(Pacer *, uint64_t, uint64_t, uint32_t, long);
+void pace_frame(Pacer *, long);
+void pace_report(Pacer *, FILE *);
+
+#endif
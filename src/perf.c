@@ -0,0 +1,155 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perf.h"
+
+#define CYCLES         0
+#define INSTRUCTIONS   1
+#define BRANCH_MISSES  2
+#define L1D_MISSES     3
+
+
+static const struct { uint32_t type; uint64_t config; } events[PERF_COUNTERS] =
+{
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+	                     PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+};
+
+static int open_event(int i, int group)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.disabled = group == -1;  // the leader starts the whole group
+	attr.exclude_kernel = 1;      // also lets unprivileged users open them
+	attr.exclude_hv = 1;
+
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+// Returns NULL if the host has no usable counters (no PMU, or blocked by
+// perf_event_paranoid), so callers can run uninstrumented
+Perf *perf_open(void)
+{
+	Perf *perf = calloc(1, sizeof(Perf));
+	perf->leader = -1;
+
+	for (int i = 0; i < PERF_COUNTERS; i++)
+	{
+		perf->fd[i] = open_event(i, perf->leader);
+		if (perf->fd[i] < 0)
+			continue;
+		if (perf->leader < 0)
+			perf->leader = perf->fd[i];
+		perf->opened++;
+	}
+
+	if (perf->leader < 0)
+	{
+		free(perf);
+		return NULL;
+	}
+
+	ioctl(perf->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(perf->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return perf;
+}
+
+void perf_close(Perf *perf)
+{
+	for (int i = 0; i < PERF_COUNTERS; i++)
+		if (perf->fd[i] >= 0)
+			close(perf->fd[i]);
+	free(perf);
+}
+
+// Find a phase by name, adding it the first time. Callers look a phase up once
+// and keep the pointer.
+PerfPhase *perf_phase(Perf *perf, const char *name)
+{
+	for (int i = 0; i < perf->phases; i++)
+		if (!strcmp(perf->phase[i].name, name))
+			return &perf->phase[i];
+
+	if (perf->phases == PERF_PHASES)
+	{
+		fprintf(stderr, "[ERROR] Too many perf phases; exiting...");
+		exit(EXIT_FAILURE);
+	}
+	PerfPhase *phase = &perf->phase[perf->phases++];
+	phase->name = name;
+	return phase;
+}
+
+// One read() for the whole group: {nr, value[nr]}, in the order opened
+static void sample(Perf *perf, uint64_t *count)
+{
+	uint64_t buffer[1 + PERF_COUNTERS];
+	if (read(perf->leader, buffer, sizeof(buffer)) < (ssize_t)((1 + perf->opened) * sizeof(uint64_t)))
+	{
+		memset(count, 0, PERF_COUNTERS * sizeof(uint64_t));
+		return;
+	}
+
+	for (int i = 0, n = 1; i < PERF_COUNTERS; i++)
+		count[i] = perf->fd[i] >= 0 ? buffer[n++] : 0;
+}
+
+void perf_begin(Perf *perf, PerfPhase *phase, uint64_t guest_instructions)
+{
+	phase->guest_start = guest_instructions;
+	sample(perf, phase->start);
+}
+
+void perf_end(Perf *perf, PerfPhase *phase, uint64_t guest_instructions)
+{
+	uint64_t now[PERF_COUNTERS];
+	sample(perf, now);
+
+	for (int i = 0; i < PERF_COUNTERS; i++)
+		phase->count[i] += now[i] - phase->start[i];
+	phase->guest += guest_instructions - phase->guest_start;
+	phase->runs++;
+}
+
+static void per_guest(Perf *perf, PerfPhase *phase, int i, FILE *f)
+{
+	if (perf->fd[i] < 0 || !phase->guest)
+		fprintf(f, " %9s", "-");
+	else
+		fprintf(f, " %9.3f", (double)phase->count[i] / phase->guest);
+}
+
+// Host cost per emulated guest instruction, one line per phase
+void perf_report(Perf *perf, FILE *f)
+{
+	fprintf(f, "%-12s %8s %12s %9s %9s %6s %9s %9s\n", "phase", "runs", "guest insts",
+	        "cycles/i", "insts/i", "IPC", "brmiss/i", "L1Dmiss/i");
+
+	for (int i = 0; i < perf->phases; i++)
+	{
+		PerfPhase *phase = &perf->phase[i];
+		fprintf(f, "%-12s %8" PRIu64 " %12" PRIu64, phase->name, phase->runs, phase->guest);
+		per_guest(perf, phase, CYCLES, f);
+		per_guest(perf, phase, INSTRUCTIONS, f);
+		if (perf->fd[CYCLES] >= 0 && perf->fd[INSTRUCTIONS] >= 0 && phase->count[CYCLES])
+			fprintf(f, " %6.2f", (double)phase->count[INSTRUCTIONS] / phase->count[CYCLES]);
+		else
+			fprintf(f, " %6s", "-");
+		per_guest(perf, phase, BRANCH_MISSES, f);
+		per_guest(perf, phase, L1D_MISSES, f);
+		fprintf(f, "\n");
+	}
+}
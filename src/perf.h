@@ -0,0 +1,43 @@
+#ifndef _PERF_H
+#define _PERF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define PERF_COUNTERS  4   // cycles, instructions, branch misses, L1D read misses
+#define PERF_PHASES    8
+
+
+// Host counter totals over every [perf_begin, perf_end) interval of one phase,
+// plus the guest instructions emulated in them
+typedef struct PerfPhase
+{
+	const char *name;
+	uint64_t runs;
+	uint64_t count[PERF_COUNTERS];
+	uint64_t guest;
+
+	uint64_t start[PERF_COUNTERS];
+	uint64_t guest_start;
+} PerfPhase;
+
+// Linux perf_event_open counters, opened as one group so a single read()
+// samples all of them. Counters the host doesn't have are left out.
+typedef struct Perf
+{
+	int leader;
+	int fd[PERF_COUNTERS];    // -1 if unavailable
+	uint8_t opened;           // counters in the group
+
+	PerfPhase phase[PERF_PHASES];
+	uint8_t phases;
+} Perf;
+
+Perf *perf_open(void);
+void perf_close(Perf *);
+PerfPhase *perf_phase(Perf *, const char *);
+void perf_begin(Perf *, PerfPhase *, uint64_t);
+void perf_end(Perf *, PerfPhase *, uint64_t);
+void perf_report(Perf *, FILE *);
+
+#endif
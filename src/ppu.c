@@ -0,0 +1,495 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "ppu.h"
+
+#define TILES_PER_LINE 36  // 33 visible with fine x scroll, padded for SIMD
+#define SPRITE_BEHIND  0x01
+#define SPRITE_ZERO    0x02
+#define BROADCAST(b)   (0x0101010101010101ULL * (b))
+
+
+// 2C02 colors, 0xRRGGBB: https://www.nesdev.org/wiki/PPU_palettes
+static const uint32_t system_palette[64] =
+{
+	0x666666, 0x002A88, 0x1412A7, 0x3B00A4, 0x5C007E, 0x6E0040, 0x6C0600, 0x561D00,
+	0x333500, 0x0B4800, 0x005200, 0x004F08, 0x00404D, 0x000000, 0x000000, 0x000000,
+	0xADADAD, 0x155FD9, 0x4240FF, 0x7527FE, 0xA01ACC, 0xB71E7B, 0xB53120, 0x994E00,
+	0x6B6D00, 0x388700, 0x0C9300, 0x008F32, 0x007C8D, 0x000000, 0x000000, 0x000000,
+	0xFFFEFF, 0x64B0FF, 0x9290FF, 0xC676FF, 0xF36AFF, 0xFE6ECC, 0xFE8170, 0xEA9E22,
+	0xBCBE00, 0x88D800, 0x5CE430, 0x45E082, 0x48CDDE, 0x4F4F4F, 0x000000, 0x000000,
+	0xFFFEFF, 0xC0DFFF, 0xD3D2FF, 0xE8C8FF, 0xFBC2FF, 0xFEC4EA, 0xFECCC5, 0xF7D8A5,
+	0xE4E594, 0xCFEF96, 0xBDF4AB, 0xB3F3CC, 0xB5EBF2, 0xB8B8B8, 0x000000, 0x000000,
+};
+
+// the same colors as RGBA bytes in memory (little-endian hosts)
+static uint32_t rgba_palette[64];
+
+
+void reset_ppu(PPU *ppu, uint8_t *chr, uint8_t chr_writable, Mirroring mirroring)
+{
+	memset(ppu, 0, sizeof(PPU));
+	ppu->chr = chr;
+	ppu->chr_writable = chr_writable;
+	ppu->mirroring = mirroring;
+
+	for (int i = 0; i < 64; i++)
+	{
+		uint32_t c = system_palette[i];
+		rgba_palette[i] = 0xFF000000 | (c & 0xFF) << 16 | (c & 0xFF00) | (c >> 16);
+	}
+}
+
+uint8_t ppu_rendering(PPU *ppu)
+{
+	return ppu->mask & 0x18;
+}
+
+
+// VRAM
+// 0x0000-0x1FFF pattern tables, 0x2000-0x2FFF nametables, 0x3F00-0x3F1F palette
+
+static uint16_t nametable_index(PPU *ppu, uint16_t addr)
+{
+	if (ppu->mirroring == VERTICAL)
+		return addr & 0x07FF;
+	return ((addr >> 1) & 0x0400) | (addr & 0x03FF);
+}
+
+// 0x3F10/14/18/1C mirror the backdrop entries
+static uint8_t palette_index(uint16_t addr)
+{
+	uint8_t i = addr & 0x1F;
+	return (i & 0x13) == 0x10 ? i & 0x0F : i;
+}
+
+static uint8_t vram_read(PPU *ppu, uint16_t addr)
+{
+	addr &= 0x3FFF;
+	if (addr < 0x2000)
+		return ppu->chr[addr];
+	if (addr < 0x3F00)
+		return ppu->nametables[nametable_index(ppu, addr)];
+	return ppu->palette[palette_index(addr)];
+}
+
+static void vram_write(PPU *ppu, uint16_t addr, uint8_t value)
+{
+	addr &= 0x3FFF;
+	if (addr < 0x2000)
+	{
+		if (ppu->chr_writable)
+			ppu->chr[addr] = value;
+	}
+	else if (addr < 0x3F00)
+		ppu->nametables[nametable_index(ppu, addr)] = value;
+	else
+		ppu->palette[palette_index(addr)] = value & 0x3F;
+}
+
+
+// REGISTERS
+// reg is the address & 7; the caller renders up to the current scanline first
+
+uint8_t ppu_read(PPU *ppu, uint8_t reg)
+{
+	uint8_t result = ppu->read_buffer;
+
+	switch (reg)
+	{
+		case 2:
+			result = (ppu->status & 0xE0) | (ppu->read_buffer & 0x1F);
+			ppu->status &= ~0x80;
+			ppu->w = 0;
+			break;
+		case 4:
+			result = ppu->oam[ppu->oam_addr];
+			break;
+		case 7:
+			// reads below the palette come through a one-byte delay buffer
+			if ((ppu->v & 0x3FFF) < 0x3F00)
+			{
+				result = ppu->read_buffer;
+				ppu->read_buffer = vram_read(ppu, ppu->v);
+			}
+			else
+			{
+				result = vram_read(ppu, ppu->v);
+				ppu->read_buffer = vram_read(ppu, ppu->v - 0x1000);
+			}
+			ppu->v += ppu->ctrl & 0x04 ? 32 : 1;
+			break;
+	}
+	return result;
+}
+
+void ppu_write(PPU *ppu, uint8_t reg, uint8_t value)
+{
+	switch (reg)
+	{
+		case 0:
+			ppu->ctrl = value;
+			ppu->t = (ppu->t & ~0x0C00) | ((uint16_t)(value & 0x03) << 10);
+			break;
+		case 1:
+			ppu->mask = value;
+			break;
+		case 3:
+			ppu->oam_addr = value;
+			break;
+		case 4:
+			ppu->oam[ppu->oam_addr++] = value;
+			break;
+		case 5:
+			if (!ppu->w)
+			{
+				ppu->t = (ppu->t & ~0x001F) | (value >> 3);
+				ppu->x = value & 0x07;
+			}
+			else
+				ppu->t = (ppu->t & ~0x73E0) | ((uint16_t)(value & 0x07) << 12) | ((uint16_t)(value & 0xF8) << 2);
+			ppu->w ^= 1;
+			break;
+		case 6:
+			if (!ppu->w)
+				ppu->t = (ppu->t & 0x00FF) | ((uint16_t)(value & 0x3F) << 8);
+			else
+			{
+				ppu->t = (ppu->t & 0xFF00) | value;
+				ppu->v = ppu->t;
+			}
+			ppu->w ^= 1;
+			break;
+		case 7:
+			vram_write(ppu, ppu->v, value);
+			ppu->v += ppu->ctrl & 0x04 ? 32 : 1;
+			break;
+	}
+}
+
+
+// RENDERING
+// Each line decodes the pattern bitplanes of all its tiles into 4-bit palette
+// indices (attribute << 2 | pixel, 0 = transparent) in one batch, then
+// composites sprites over them into the RGBA framebuffer.
+
+#if defined(__AVX2__)
+// 4 tiles (32 pixels) per step: each plane byte is shuffled out to 8 lanes and
+// tested against a per-lane bit mask
+static void decode_tiles(const uint8_t *lo, const uint8_t *hi, const uint8_t *attr, int tiles, uint8_t *out)
+{
+	const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+	                                        2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+	const __m256i bit = _mm256_set1_epi64x(0x0102040810204080LL);
+	const __m256i one = _mm256_set1_epi8(1);
+	const __m256i two = _mm256_set1_epi8(2);
+
+	for (int i = 0; i < tiles; i += 4)
+	{
+		uint32_t l4, h4, a4;
+		memcpy(&l4, lo + i, 4);
+		memcpy(&h4, hi + i, 4);
+		memcpy(&a4, attr + i, 4);
+
+		__m256i l = _mm256_shuffle_epi8(_mm256_set1_epi32(l4), spread);
+		__m256i h = _mm256_shuffle_epi8(_mm256_set1_epi32(h4), spread);
+		__m256i a = _mm256_shuffle_epi8(_mm256_set1_epi32(a4), spread);
+
+		__m256i px = _mm256_or_si256(
+			_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(l, bit), bit), one),
+			_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(h, bit), bit), two));
+		__m256i opaque = _mm256_andnot_si256(_mm256_cmpeq_epi8(px, _mm256_setzero_si256()), a);
+
+		_mm256_storeu_si256((__m256i *)(out + i * 8), _mm256_or_si256(px, opaque));
+	}
+}
+#elif defined(__SSE2__)
+// 2 tiles (16 pixels) per step: each plane byte is broadcast to 8 lanes and
+// tested against a per-lane bit mask
+static void decode_tiles(const uint8_t *lo, const uint8_t *hi, const uint8_t *attr, int tiles, uint8_t *out)
+{
+	const __m128i bit = _mm_set1_epi64x(0x0102040810204080LL);
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i two = _mm_set1_epi8(2);
+
+	for (int i = 0; i < tiles; i += 2)
+	{
+		__m128i l = _mm_set_epi64x(BROADCAST(lo[i + 1]), BROADCAST(lo[i]));
+		__m128i h = _mm_set_epi64x(BROADCAST(hi[i + 1]), BROADCAST(hi[i]));
+		__m128i a = _mm_set_epi64x(BROADCAST(attr[i + 1]), BROADCAST(attr[i]));
+
+		__m128i px = _mm_or_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(l, bit), bit), one),
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(h, bit), bit), two));
+		__m128i opaque = _mm_andnot_si128(_mm_cmpeq_epi8(px, _mm_setzero_si128()), a);
+
+		_mm_storeu_si128((__m128i *)(out + i * 8), _mm_or_si128(px, opaque));
+	}
+}
+#else
+static void decode_tiles(const uint8_t *lo, const uint8_t *hi, const uint8_t *attr, int tiles, uint8_t *out)
+{
+	for (int i = 0; i < tiles; i++)
+	{
+		for (int b = 0; b < 8; b++)
+		{
+			uint8_t px = ((lo[i] >> (7 - b)) & 1) | (((hi[i] >> (7 - b)) & 1) << 1);
+			*out++ = px ? attr[i] | px : 0;
+		}
+	}
+}
+#endif
+
+static void render_background(PPU *ppu, uint8_t *line)
+{
+	uint8_t lo[TILES_PER_LINE], hi[TILES_PER_LINE], attr[TILES_PER_LINE];
+	uint8_t pixels[TILES_PER_LINE * 8];
+	uint16_t v = ppu->v;
+	uint16_t table = ppu->ctrl & 0x10 ? 0x1000 : 0x0000;
+	uint16_t fine_y = (v >> 12) & 0x07;
+
+	for (int i = 0; i < TILES_PER_LINE; i++)
+	{
+		uint8_t tile = ppu->nametables[nametable_index(ppu, v)];
+		uint16_t attr_addr = 0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07);
+		uint8_t shift = ((v >> 4) & 0x04) | (v & 0x02);
+
+		attr[i] = ((ppu->nametables[nametable_index(ppu, attr_addr)] >> shift) & 0x03) << 2;
+		lo[i] = ppu->chr[table + tile * 16 + fine_y];
+		hi[i] = ppu->chr[table + tile * 16 + fine_y + 8];
+
+		// coarse x, wrapping into the next horizontal nametable
+		if ((v & 0x001F) == 31)
+			v = (v & ~0x001F) ^ 0x0400;
+		else
+			v++;
+	}
+
+	decode_tiles(lo, hi, attr, TILES_PER_LINE, pixels);
+	memcpy(line, pixels + ppu->x, SCREEN_WIDTH);
+}
+
+// Pattern bits of a sprite's row on the current line; 0 if it isn't on it
+static int sprite_row(PPU *ppu, uint8_t *sprite, uint8_t height, uint8_t *lo, uint8_t *hi)
+{
+	int row = (int)ppu->line - sprite[0] - 1;
+	if (row < 0 || row >= height)
+		return 0;
+
+	uint8_t tile = sprite[1], attributes = sprite[2];
+	uint16_t table;
+
+	if (attributes & 0x80)
+		row = height - 1 - row;
+	if (height == 16)
+	{
+		table = tile & 0x01 ? 0x1000 : 0x0000;
+		tile = (tile & 0xFE) + (row >= 8);
+		row &= 0x07;
+	}
+	else
+		table = ppu->ctrl & 0x08 ? 0x1000 : 0x0000;
+
+	*lo = ppu->chr[table + tile * 16 + row];
+	*hi = ppu->chr[table + tile * 16 + row + 8];
+	return 1;
+}
+
+// Sprites covering the current line, in OAM order; earlier sprites win
+static void render_sprites(PPU *ppu, uint8_t *line, uint8_t *flags)
+{
+	uint8_t height = ppu->ctrl & 0x20 ? 16 : 8;
+	uint8_t count = 0;
+
+	for (int i = 0; i < 64; i++)
+	{
+		uint8_t *sprite = &ppu->oam[i * 4];
+		uint8_t lo, hi;
+		if (!sprite_row(ppu, sprite, height, &lo, &hi))
+			continue;
+		if (++count > 8)
+		{
+			ppu->status |= 0x20;
+			break;
+		}
+
+		uint8_t attributes = sprite[2], x = sprite[3];
+		uint8_t palette = 0x10 | (attributes & 0x03) << 2;
+
+		for (int b = 0; b < 8 && x + b < SCREEN_WIDTH; b++)
+		{
+			int bit = attributes & 0x40 ? b : 7 - b;
+			uint8_t px = ((lo >> bit) & 1) | (((hi >> bit) & 1) << 1);
+			if (!px || line[x + b])
+				continue;
+			line[x + b] = palette | px;
+			flags[x + b] = (attributes & 0x20 ? SPRITE_BEHIND : 0) | (i == 0 ? SPRITE_ZERO : 0);
+		}
+	}
+}
+
+static void increment_y(PPU *ppu)
+{
+	if ((ppu->v & 0x7000) != 0x7000)
+	{
+		ppu->v += 0x1000;
+		return;
+	}
+
+	uint16_t coarse_y = (ppu->v & 0x03E0) >> 5;
+	ppu->v &= ~0x7000;
+	if (coarse_y == 29)
+	{
+		coarse_y = 0;
+		ppu->v ^= 0x0800;
+	}
+	else if (coarse_y == 31)
+		coarse_y = 0;
+	else
+		coarse_y++;
+	ppu->v = (ppu->v & ~0x03E0) | (coarse_y << 5);
+}
+
+static void render_line(PPU *ppu)
+{
+	uint8_t bg[SCREEN_WIDTH] = {0}, sprites[SCREEN_WIDTH] = {0}, flags[SCREEN_WIDTH];
+	uint32_t *out = &ppu->framebuffer[ppu->line * SCREEN_WIDTH];
+
+	if (!ppu_rendering(ppu))
+	{
+		uint32_t backdrop = rgba_palette[ppu->palette[0]];
+		for (int x = 0; x < SCREEN_WIDTH; x++)
+			out[x] = backdrop;
+		return;
+	}
+
+	if (ppu->mask & 0x08)
+	{
+		render_background(ppu, bg);
+		if (!(ppu->mask & 0x02))
+			memset(bg, 0, 8);
+	}
+	if (ppu->mask & 0x10)
+	{
+		render_sprites(ppu, sprites, flags);
+		if (!(ppu->mask & 0x04))
+			memset(sprites, 0, 8);
+	}
+
+	for (int x = 0; x < SCREEN_WIDTH; x++)
+	{
+		uint8_t px = bg[x];
+		if (sprites[x])
+		{
+			if (px && (flags[x] & SPRITE_ZERO) && x != 255)
+				ppu->status |= 0x40;
+			if (!px || !(flags[x] & SPRITE_BEHIND))
+				px = sprites[x];
+		}
+		out[x] = rgba_palette[ppu->palette[px]];
+	}
+
+	// end of line: next row, and reload the horizontal scroll (dot 257)
+	increment_y(ppu);
+	ppu->v = (ppu->v & ~0x041F) | (ppu->t & 0x041F);
+}
+
+// The current line without pixels: the same sprite overflow, sprite 0 hit and
+// VRAM address changes as render_line, looking only at sprite 0's pixels
+static void shadow_line(PPU *ppu)
+{
+	if (!ppu_rendering(ppu))
+		return;
+
+	uint8_t height = ppu->ctrl & 0x20 ? 16 : 8;
+	uint8_t lo, hi;
+
+	if (ppu->mask & 0x10)
+	{
+		uint8_t count = 0;
+		for (int i = 0; i < 64 && count <= 8; i++)
+		{
+			int row = (int)ppu->line - ppu->oam[i * 4] - 1;
+			if (row >= 0 && row < height)
+				count++;
+		}
+		if (count > 8)
+			ppu->status |= 0x20;
+	}
+
+	// both layers have to be on for a hit; the left 8 pixels can be clipped
+	if ((ppu->mask & 0x18) == 0x18 && !(ppu->status & 0x40) && sprite_row(ppu, ppu->oam, height, &lo, &hi))
+	{
+		uint8_t attributes = ppu->oam[2], x = ppu->oam[3];
+		uint8_t clip = (ppu->mask & 0x06) == 0x06 ? 0 : 8;
+
+		for (int b = 0; b < 8 && x + b < SCREEN_WIDTH - 1; b++)
+		{
+			int bit = attributes & 0x40 ? b : 7 - b;
+			if (x + b < clip || !(((lo | hi) >> bit) & 1))
+				continue;
+
+			// the background pixel under it, counted in tiles from v
+			int col = x + b + ppu->x;
+			uint16_t v = ppu->v;
+			for (int i = 0; i < col / 8; i++)
+				v = (v & 0x001F) == 31 ? (v & ~0x001F) ^ 0x0400 : v + 1;
+
+			uint8_t tile = ppu->nametables[nametable_index(ppu, v)];
+			uint16_t addr = (ppu->ctrl & 0x10 ? 0x1000 : 0x0000) + tile * 16 + ((v >> 12) & 0x07);
+			if (((ppu->chr[addr] | ppu->chr[addr + 8]) >> (7 - col % 8)) & 1)
+			{
+				ppu->status |= 0x40;
+				break;
+			}
+		}
+	}
+
+	increment_y(ppu);
+	ppu->v = (ppu->v & ~0x041F) | (ppu->t & 0x041F);
+}
+
+void ppu_begin_frame(PPU *ppu)
+{
+	ppu->line = 0;
+	if (ppu_rendering(ppu))
+		ppu->v = ppu->t;
+}
+
+// Render every line before `line` that hasn't been drawn yet this frame
+void ppu_render_to(PPU *ppu, uint16_t line)
+{
+	if (line > SCREEN_HEIGHT)
+		line = SCREEN_HEIGHT;
+	while (ppu->line < line)
+	{
+		if (ppu->shadow)
+			shadow_line(ppu);
+		else
+			render_line(ppu);
+		ppu->line++;
+	}
+}
+
+void ppu_write_ppm(PPU *ppu, char *file_name)
+{
+	FILE *f = fopen(file_name, "wb");
+	if (f == NULL)
+	{
+		perror("fopen");
+		return;
+	}
+
+	fprintf(f, "P6\n%d %d\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+	for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++)
+	{
+		uint32_t c = ppu->framebuffer[i];
+		uint8_t rgb[3] = {c & 0xFF, (c >> 8) & 0xFF, (c >> 16) & 0xFF};
+		fwrite(rgb, 1, 3, f);
+	}
+	fclose(f);
+}
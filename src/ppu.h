@@ -0,0 +1,57 @@
+#ifndef _PPU_H
+#define _PPU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SCREEN_WIDTH   256
+#define SCREEN_HEIGHT  240
+
+typedef enum Mirroring
+{
+	HORIZONTAL,
+	VERTICAL
+} Mirroring;
+
+
+// 2C02 picture processing unit, rendered a scanline at a time
+// register details: https://www.nesdev.org/wiki/PPU_registers
+typedef struct PPU
+{
+	// registers
+	uint8_t  ctrl;         // 0x2000
+	uint8_t  mask;         // 0x2001
+	uint8_t  status;       // 0x2002
+	uint8_t  oam_addr;     // 0x2003
+	uint8_t  read_buffer;  // delayed 0x2007 reads
+
+	// scroll/address registers: https://www.nesdev.org/wiki/PPU_scrolling
+	uint16_t v;            // current VRAM address
+	uint16_t t;            // temporary VRAM address
+	uint8_t  x;            // fine x scroll
+	uint8_t  w;            // first/second write toggle
+
+	// memory
+	uint8_t  *chr;         // pattern tables, 0x0000-0x1FFF
+	uint8_t   chr_writable;
+	Mirroring mirroring;
+	uint8_t   nametables[0x800];
+	uint8_t   palette[32];
+	uint8_t   oam[256];
+
+	// next scanline to render
+	uint16_t line;
+	uint8_t  shadow;       // lines only update state and status; no pixels
+
+	uint32_t framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT];  // RGBA
+} PPU;
+
+void reset_ppu(PPU *, uint8_t *, uint8_t, Mirroring);
+uint8_t ppu_read(PPU *, uint8_t);
+void ppu_write(PPU *, uint8_t, uint8_t);
+void ppu_begin_frame(PPU *);
+void ppu_render_to(PPU *, uint16_t);
+uint8_t ppu_rendering(PPU *);
+void ppu_write_ppm(PPU *, char *);
+
+#endif
@@ -0,0 +1,136 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include "render.h"
+
+
+// Replays one frame's accesses between scanlines, exactly as the CPU side
+// would have interleaved them with rendering
+static void draw(Renderer *r, FrameLog *frame)
+{
+	PPU *ppu = &r->ppu;
+	memcpy(ppu, frame->start, sizeof(frame->start));
+	ppu->shadow = 0;
+	if (ppu->chr_writable)
+	{
+		memcpy(r->chr, frame->chr_ram, CHR_BANK);
+		ppu->chr = r->chr;
+	}
+
+	for (size_t i = 0; i < frame->count; i++)
+	{
+		PpuAccess *a = &frame->log[i];
+		ppu_render_to(ppu, a->line);
+		if (a->reg & RENDER_READ)
+			ppu_read(ppu, a->reg & 0x07);
+		else
+			ppu_write(ppu, a->reg, a->value);
+	}
+	ppu_render_to(ppu, SCREEN_HEIGHT);
+}
+
+static void *render_thread(void *data)
+{
+	Renderer *r = data;
+	uint64_t rendered = 0;
+
+	for (;;)
+	{
+		if (rendered == atomic_load_explicit(&r->published, memory_order_acquire))
+		{
+			if (atomic_load_explicit(&r->done, memory_order_acquire) &&
+			    rendered == atomic_load_explicit(&r->published, memory_order_acquire))
+				break;
+			nanosleep(&(struct timespec){0, 20000}, NULL);
+			continue;
+		}
+
+		draw(r, &r->frames[rendered & 1]);
+		atomic_store_explicit(&r->rendered, ++rendered, memory_order_release);
+	}
+	return NULL;
+}
+
+// Pipelined rendering: from here on the NES's own PPU only keeps the state and
+// status flags the CPU can see, and frames are drawn on another thread. NULL if
+// the thread can't be started, leaving rendering synchronous.
+Renderer *render_open(NES *nes)
+{
+	Renderer *r = calloc(1, sizeof(Renderer));
+	if (r == NULL)
+		return NULL;
+	for (int i = 0; i < 2; i++)
+		render_grow(&r->frames[i]);
+	if (pthread_create(&r->thread, NULL, render_thread, r) != 0)
+	{
+		free(r->frames[0].log);
+		free(r->frames[1].log);
+		free(r);
+		return NULL;
+	}
+	nes->renderer = r;
+	nes->ppu.shadow = 1;
+	return r;
+}
+
+// Waits for the last frame, which becomes the NES's framebuffer again, and
+// goes back to rendering synchronously
+void render_close(NES *nes)
+{
+	Renderer *r = nes->renderer;
+	atomic_store_explicit(&r->done, 1, memory_order_release);
+	pthread_join(r->thread, NULL);
+
+	memcpy(nes->ppu.framebuffer, r->ppu.framebuffer, sizeof(r->ppu.framebuffer));
+	nes->ppu.shadow = 0;
+	nes->renderer = NULL;
+	free(r->frames[0].log);
+	free(r->frames[1].log);
+	free(r);
+}
+
+// Start logging a frame, once the render thread is done with the log it needs
+void render_begin(Renderer *r, PPU *ppu)
+{
+	uint64_t published = atomic_load_explicit(&r->published, memory_order_relaxed);
+	if (published - atomic_load_explicit(&r->rendered, memory_order_acquire) >= 2)
+	{
+		r->stalls++;
+		while (published - atomic_load_explicit(&r->rendered, memory_order_acquire) >= 2)
+			sched_yield();
+	}
+
+	FrameLog *frame = &r->frames[published & 1];
+	memcpy(frame->start, ppu, sizeof(frame->start));
+	if (ppu->chr_writable)
+		memcpy(frame->chr_ram, ppu->chr, CHR_BANK);
+	frame->count = 0;
+	r->filling = frame;
+}
+
+// Make room for more accesses: RENDER_LOG to start with, then twice as many. The
+// render thread only reads a log once it's published, so it can move freely.
+void render_grow(FrameLog *frame)
+{
+	size_t capacity = frame->capacity ? frame->capacity * 2 : RENDER_LOG;
+	PpuAccess *log = realloc(frame->log, capacity * sizeof(PpuAccess));
+	if (log == NULL)
+	{
+		fprintf(stderr, "[ERROR] Out of memory for the render log; exiting...");
+		exit(EXIT_FAILURE);
+	}
+	frame->log = log;
+	frame->capacity = capacity;
+}
+
+// The frame's visible lines are over; hand it to the render thread
+void render_publish(Renderer *r)
+{
+	if (r->filling == NULL)
+		return;
+	r->filling = NULL;
+	atomic_fetch_add_explicit(&r->published, 1, memory_order_release);
+}
@@ -0,0 +1,71 @@
+#ifndef _RENDER_H
+#define _RENDER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "nes.h"
+
+// PPU accesses a frame's log starts with room for. Ordinary frames stay well
+// under it; a guest hammering the registers all frame grows the log instead.
+#define RENDER_LOG   (1 << 14)
+#define RENDER_READ  0x08  // the access was a register read
+
+
+typedef struct PpuAccess
+{
+	uint16_t line;   // lines the CPU-side PPU had finished
+	uint8_t  reg;    // register | RENDER_READ
+	uint8_t  value;
+} PpuAccess;
+
+// Everything the render thread needs to draw one frame: the PPU as the frame
+// began, and every register access up to vblank
+typedef struct FrameLog
+{
+	uint8_t   start[offsetof(PPU, framebuffer)];
+	uint8_t   chr_ram[CHR_BANK];  // only when the cart has CHR RAM
+	PpuAccess *log;
+	size_t    count;
+	size_t    capacity;
+} FrameLog;
+
+// The CPU thread fills one log while the render thread draws the other. Frame n
+// uses frames[n & 1]; the counters are the only synchronization.
+typedef struct Renderer
+{
+	FrameLog frames[2];
+	FrameLog *filling;             // log being written, NULL outside a frame
+	_Atomic uint64_t published;    // frames handed to the render thread
+	_Atomic uint64_t rendered;     // frames it has finished
+	_Atomic int      done;
+	uint64_t stalls;               // times the CPU thread waited for a free log
+
+	PPU     ppu;                   // the render thread's PPU, and the image
+	uint8_t chr[CHR_BANK];
+	pthread_t thread;
+} Renderer;
+
+Renderer *render_open(NES *);
+void render_close(NES *);
+void render_begin(Renderer *, PPU *);
+void render_publish(Renderer *);
+void render_grow(FrameLog *);
+
+
+static inline void render_log(Renderer *r, uint16_t line, uint8_t reg, uint8_t value)
+{
+	FrameLog *frame = r->filling;
+	if (frame == NULL)
+		return;
+	if (frame->count == frame->capacity)
+		render_grow(frame);
+
+	PpuAccess *a = &frame->log[frame->count++];
+	a->line = line;
+	a->reg = reg;
+	a->value = value;
+}
+
+#endif
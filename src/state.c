@@ -0,0 +1,237 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "state.h"
+
+#define HASH_K1  0x9E3779B97F4A7C15ULL
+#define HASH_K2  0xC2B2AE3D27D4EB4FULL
+
+
+// splitmix64's finalizer
+static uint64_t mix(uint64_t h)
+{
+	h ^= h >> 30;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 27;
+	h *= 0x94D049BB133111EBULL;
+	return h ^ (h >> 31);
+}
+
+static uint64_t hash_bytes(const uint8_t *bytes, size_t len, uint64_t seed)
+{
+	uint64_t h = seed * HASH_K1;
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		h = (h ^ word * HASH_K2) * HASH_K1;
+		h ^= h >> 29;
+	}
+	for (; i < len; i++)
+		h = (h ^ bytes[i]) * HASH_K1;
+
+	return mix(h ^ len);
+}
+
+
+// FINGERPRINTS
+// Every page keeps its own hash, recomputed only after a store dirties it, and
+// the memory hash is their sum, so it's updated by the difference. Taking a
+// fingerprint costs one pass over the dirty flags plus a hash of each dirty page.
+
+uint64_t state_fingerprint(CPU *cpu)
+{
+	for (size_t word = 0; word < PAGES / 8; word++)
+	{
+		uint64_t flags;
+		memcpy(&flags, &cpu->dirty[word * 8], 8);
+		if (!(flags & 0x0101010101010101ULL * DIRTY_HASH))
+			continue;
+
+		for (size_t page = word * 8; page < word * 8 + 8; page++)
+		{
+			if (!(cpu->dirty[page] & DIRTY_HASH))
+				continue;
+
+			// seeded with the page number, so moving data between pages changes the sum
+			uint64_t h = hash_bytes(&cpu->memory[page * BYTES_PER_PAGE], BYTES_PER_PAGE, page + 1);
+			cpu->memory_hash += h - cpu->page_hash[page];
+			cpu->page_hash[page] = h;
+			cpu->dirty[page] &= ~DIRTY_HASH;
+		}
+	}
+
+	return mix(cpu->memory_hash ^ hash_bytes((const uint8_t *)&cpu->reg, sizeof(Registers), PAGES + 1));
+}
+
+// Registers and memory, exactly; fingerprints rule out most mismatches first
+int state_equal(CPU *a, CPU *b)
+{
+	if (state_fingerprint(a) != state_fingerprint(b))
+		return 0;
+	return !memcmp(&a->reg, &b->reg, sizeof(Registers)) && !memcmp(a->memory, b->memory, ADDRESS_BYTES);
+}
+
+
+// SNAPSHOTS
+// Memory is copied in whole pages, and after the first take only the pages
+// marked DIRTY_SNAPSHOT differ between the CPU and its snapshot.
+
+static void copy_registers(CPU *cpu, Snapshot *snap, int restore)
+{
+	if (restore)
+	{
+		cpu->reg = snap->reg;
+		cpu->total_cycles = snap->total_cycles;
+		cpu->pending = snap->pending;
+		cpu->irq_lines = snap->irq_lines;
+		cpu->nmi_line = snap->nmi_line;
+		cpu->irq_mask = snap->irq_mask;
+		cpu->irq_start = snap->irq_start;
+		cpu->jammed = snap->jammed;
+		cpu->stop = snap->stop;
+		cpu->port_ddr = snap->port_ddr;
+		cpu->port_out = snap->port_out;
+		cpu->instructions = snap->instructions;
+		cpu->fused = snap->fused;
+		cpu->idle.valid = 0;
+	}
+	else
+	{
+		snap->reg = cpu->reg;
+		snap->total_cycles = cpu->total_cycles;
+		snap->pending = cpu->pending;
+		snap->irq_lines = cpu->irq_lines;
+		snap->nmi_line = cpu->nmi_line;
+		snap->irq_mask = cpu->irq_mask;
+		snap->irq_start = cpu->irq_start;
+		snap->jammed = cpu->jammed;
+		snap->stop = cpu->stop;
+		snap->port_ddr = cpu->port_ddr;
+		snap->port_out = cpu->port_out;
+		snap->instructions = cpu->instructions;
+		snap->fused = cpu->fused;
+	}
+}
+
+void snapshot_take(CPU *cpu, Snapshot *snap)
+{
+	copy_registers(cpu, snap, 0);
+
+	if (snap->owner != cpu)
+	{
+		memcpy(snap->memory, cpu->memory, ADDRESS_BYTES);
+		for (size_t page = 0; page < PAGES; page++)
+			cpu->dirty[page] &= ~DIRTY_SNAPSHOT;
+		snap->owner = cpu;
+		return;
+	}
+
+	for (size_t page = 0; page < PAGES; page++)
+	{
+		if (!(cpu->dirty[page] & DIRTY_SNAPSHOT))
+			continue;
+		memcpy(&snap->memory[page * BYTES_PER_PAGE], &cpu->memory[page * BYTES_PER_PAGE], BYTES_PER_PAGE);
+		cpu->dirty[page] &= ~DIRTY_SNAPSHOT;
+	}
+}
+
+// The snapshot must have been taken from this CPU
+void snapshot_restore(CPU *cpu, Snapshot *snap)
+{
+	copy_registers(cpu, snap, 1);
+
+	for (size_t page = 0; page < PAGES; page++)
+	{
+		if (!(cpu->dirty[page] & DIRTY_SNAPSHOT))
+			continue;
+
+		uint16_t first = page * BYTES_PER_PAGE;
+		memcpy(&cpu->memory[first], &snap->memory[first], BYTES_PER_PAGE);
+		cpu->dirty[page] = 0xFF & ~DIRTY_SNAPSHOT;  // changed for every other consumer
+		if (cpu->code_page[page])
+			invalidate_code(cpu, first, first + BYTES_PER_PAGE - 1);
+	}
+
+	// the banking follows the restored port ($01 holds its pins)
+	if (cpu->port_handler)
+		cpu->port_handler(cpu->port_owner, cpu->memory[1]);
+}
+
+
+// STATE SETS
+// Linear probing on the fingerprint itself, which is already well mixed; the
+// table doubles at half full. 0 marks an empty slot, so it's stored as 1.
+
+StateSet *stateset_new(size_t expected)
+{
+	StateSet *set = calloc(1, sizeof(StateSet));
+	set->capacity = 16;
+	while (set->capacity < expected * 2)
+		set->capacity *= 2;
+
+	set->slots = calloc(set->capacity, sizeof(uint64_t));
+	if (set->slots == NULL)
+	{
+		fprintf(stderr, "[ERROR] Out of memory for state set; exiting...");
+		exit(EXIT_FAILURE);
+	}
+	return set;
+}
+
+void stateset_free(StateSet *set)
+{
+	free(set->slots);
+	free(set);
+}
+
+static uint64_t *find_slot(uint64_t *slots, size_t capacity, uint64_t fingerprint)
+{
+	size_t i = fingerprint & (capacity - 1);
+	while (slots[i] && slots[i] != fingerprint)
+		i = (i + 1) & (capacity - 1);
+	return &slots[i];
+}
+
+static void grow(StateSet *set)
+{
+	size_t capacity = set->capacity * 2;
+	uint64_t *slots = calloc(capacity, sizeof(uint64_t));
+	if (slots == NULL)
+	{
+		fprintf(stderr, "[ERROR] Out of memory for state set; exiting...");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < set->capacity; i++)
+		if (set->slots[i])
+			*find_slot(slots, capacity, set->slots[i]) = set->slots[i];
+
+	free(set->slots);
+	set->slots = slots;
+	set->capacity = capacity;
+}
+
+// Returns 1 if the fingerprint is new, 0 if it was already in the set
+int stateset_insert(StateSet *set, uint64_t fingerprint)
+{
+	fingerprint += !fingerprint;
+
+	uint64_t *slot = find_slot(set->slots, set->capacity, fingerprint);
+	if (*slot)
+		return 0;
+
+	*slot = fingerprint;
+	if (++set->count * 2 > set->capacity)
+		grow(set);
+	return 1;
+}
+
+int stateset_contains(StateSet *set, uint64_t fingerprint)
+{
+	fingerprint += !fingerprint;
+	return *find_slot(set->slots, set->capacity, fingerprint) != 0;
+}
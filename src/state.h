@@ -0,0 +1,48 @@
+#ifndef _STATE_H
+#define _STATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu.h"
+
+
+// CPU state at one point in time. After the first take, taking or restoring
+// only copies the pages stored to since (DIRTY_SNAPSHOT), so a CPU should
+// track one snapshot at a time.
+typedef struct Snapshot
+{
+	CPU *owner;          // CPU the memory copy is in step with
+	Registers reg;
+	uint64_t total_cycles;
+	uint8_t  pending;
+	uint32_t irq_lines;
+	uint8_t  nmi_line;
+	uint8_t  irq_mask;
+	uint64_t irq_start;
+	uint8_t  jammed;
+	StopReason stop;
+	uint8_t  port_ddr, port_out;
+	uint64_t instructions, fused;  // so rewound work drops out of the counts
+	uint8_t  memory[ADDRESS_BYTES];
+} Snapshot;
+
+// Open-addressed set of state fingerprints, for "have we seen this state?"
+typedef struct StateSet
+{
+	uint64_t *slots;   // 0 = empty
+	size_t capacity;   // power of 2
+	size_t count;
+} StateSet;
+
+uint64_t state_fingerprint(CPU *);
+int state_equal(CPU *, CPU *);
+
+void snapshot_take(CPU *, Snapshot *);
+void snapshot_restore(CPU *, Snapshot *);
+
+StateSet *stateset_new(size_t);
+void stateset_free(StateSet *);
+int stateset_insert(StateSet *, uint64_t);
+int stateset_contains(StateSet *, uint64_t);
+
+#endif
@@ -0,0 +1,225 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+#define WRITE_BUFFER   (1 << 16)
+
+// Compressed format, after the 8-byte magic, per record:
+//   uint16 mask      bit i set if byte i of the record (up to the cycle) changed
+//   changed bytes    in order
+//   varint           cycle delta from the previous record, 7 bits per byte
+// The first record is compared against an all-zero one.
+
+
+// WRITER
+
+static size_t encode(const TraceRecord *r, const TraceRecord *prev, uint8_t *out)
+{
+	const uint8_t *a = (const uint8_t *)r, *b = (const uint8_t *)prev;
+	uint16_t mask = 0;
+	size_t n = 2;
+
+	for (int i = 0; i < TRACE_FIELDS; i++)
+	{
+		if (a[i] != b[i])
+		{
+			mask |= 1 << i;
+			out[n++] = a[i];
+		}
+	}
+	out[0] = mask & 0xFF;
+	out[1] = mask >> 8;
+
+	uint64_t delta = trace_cycle(r) - trace_cycle(prev);
+	do
+	{
+		out[n++] = (delta & 0x7F) | (delta > 0x7F ? 0x80 : 0);
+		delta >>= 7;
+	} while (delta);
+
+	return n;
+}
+
+static void *writer(void *data)
+{
+	Trace *trace = data;
+	TraceRecord prev = {0};
+	uint8_t *buffer = malloc(WRITE_BUFFER + 64);
+	size_t len = 0;
+
+	for (;;)
+	{
+		size_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+		size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+
+		if (head == tail)
+		{
+			if (atomic_load_explicit(&trace->done, memory_order_acquire) &&
+			    head == atomic_load_explicit(&trace->head, memory_order_acquire))
+				break;
+			nanosleep(&(struct timespec){0, 100000}, NULL);
+			continue;
+		}
+
+		for (; tail != head; tail++)
+		{
+			TraceRecord *r = &trace->ring[tail & (TRACE_RING - 1)];
+			len += encode(r, &prev, buffer + len);
+			prev = *r;
+			if (len >= WRITE_BUFFER)
+			{
+				fwrite(buffer, 1, len, trace->f);
+				len = 0;
+			}
+		}
+		atomic_store_explicit(&trace->tail, tail, memory_order_release);
+	}
+
+	fwrite(buffer, 1, len, trace->f);
+	fflush(trace->f);
+	free(buffer);
+	return NULL;
+}
+
+Trace *trace_open(FILE *f)
+{
+	Trace *trace = calloc(1, sizeof(Trace));
+	trace->f = f;
+	fwrite(TRACE_MAGIC, 1, 8, f);
+
+	if (pthread_create(&trace->thread, NULL, writer, trace) != 0)
+	{
+		fprintf(stderr, "[ERROR] Could not start trace writer; exiting...");
+		exit(EXIT_FAILURE);
+	}
+	return trace;
+}
+
+// Waits for every record to be written; the file stays open
+void trace_close(Trace *trace)
+{
+	atomic_store_explicit(&trace->done, 1, memory_order_release);
+	pthread_join(trace->thread, NULL);
+	free(trace);
+}
+
+
+// READER
+
+int trace_reader_open(TraceReader *reader, FILE *f)
+{
+	char magic[8];
+
+	memset(reader, 0, sizeof(TraceReader));
+	reader->f = f;
+	return fread(magic, 1, 8, f) == 8 && memcmp(magic, TRACE_MAGIC, 8) == 0 ? 0 : -1;
+}
+
+// Returns 1 for a record, 0 at the end of the trace
+int trace_read(TraceReader *reader, TraceRecord *r)
+{
+	uint8_t mask[2];
+	uint8_t *bytes = (uint8_t *)r;
+
+	if (fread(mask, 1, 2, reader->f) != 2)
+		return 0;
+
+	*r = reader->prev;
+	for (int i = 0; i < TRACE_FIELDS; i++)
+	{
+		if ((mask[0] | mask[1] << 8) & 1 << i)
+		{
+			int c = fgetc(reader->f);
+			if (c == EOF)
+				return 0;
+			bytes[i] = c;
+		}
+	}
+
+	uint64_t delta = 0;
+	for (int shift = 0; ; shift += 7)
+	{
+		int c = fgetc(reader->f);
+		if (c == EOF)
+			return 0;
+		delta |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+			break;
+	}
+
+	uint64_t cycle = trace_cycle(r) + delta;
+	r->cycle_hi = cycle >> 32;
+	r->cycle_lo = (uint32_t)cycle;
+	reader->prev = *r;
+	return 1;
+}
+
+uint64_t trace_cycle(const TraceRecord *r)
+{
+	return (uint64_t)r->cycle_hi << 32 | r->cycle_lo;
+}
+
+
+// TEXT
+// The nestest.log layout, e.g.
+// C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+// Operand values ("= 5A") aren't in the trace, so they're left out. PPU
+// positions assume NTSC and no skipped dots.
+
+static void disassemble(const TraceRecord *r, char *out, size_t size)
+{
+	Instruction *inst = &instruction_table[r->opcode];
+	uint8_t lo = r->operand[0], hi = r->operand[1];
+	uint16_t (*mode)(CPU *) = inst->addr_mode;
+	const char *name = inst->name;
+
+	if (mode == accumulator)
+		snprintf(out, size, "%.3s A", name);
+	else if (mode == immediate)
+		snprintf(out, size, "%.3s #$%02X", name, lo);
+	else if (mode == zero_page)
+		snprintf(out, size, "%.3s $%02X", name, lo);
+	else if (mode == zero_offset_x)
+		snprintf(out, size, "%.3s $%02X,X", name, lo);
+	else if (mode == zero_offset_y)
+		snprintf(out, size, "%.3s $%02X,Y", name, lo);
+	else if (mode == absolute)
+		snprintf(out, size, "%.3s $%02X%02X", name, hi, lo);
+	else if (mode == abs_offset_x)
+		snprintf(out, size, "%.3s $%02X%02X,X", name, hi, lo);
+	else if (mode == abs_offset_y)
+		snprintf(out, size, "%.3s $%02X%02X,Y", name, hi, lo);
+	else if (mode == indirect)
+		snprintf(out, size, "%.3s ($%02X%02X)", name, hi, lo);
+	else if (mode == zero_indirect_x)
+		snprintf(out, size, "%.3s ($%02X,X)", name, lo);
+	else if (mode == zero_indirect_y)
+		snprintf(out, size, "%.3s ($%02X),Y", name, lo);
+	else if (mode == relative)
+		snprintf(out, size, "%.3s $%04X", name, (uint16_t)(r->PC + 2 + (int8_t)lo));
+	else
+		snprintf(out, size, "%.3s", name);
+}
+
+void trace_format(const TraceRecord *r, char *out, size_t size)
+{
+	char bytes[16], text[32];
+	uint8_t len = inst_length(&instruction_table[r->opcode]);
+	uint64_t cycle = trace_cycle(r);
+	uint64_t dot = cycle * 3;
+
+	if (len == 1)
+		snprintf(bytes, sizeof(bytes), "%02X", r->opcode);
+	else if (len == 2)
+		snprintf(bytes, sizeof(bytes), "%02X %02X", r->opcode, r->operand[0]);
+	else
+		snprintf(bytes, sizeof(bytes), "%02X %02X %02X", r->opcode, r->operand[0], r->operand[1]);
+	disassemble(r, text, sizeof(text));
+
+	snprintf(out, size, "%04X  %-8s  %-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3u,%3u CYC:%llu",
+	         r->PC, bytes, text, r->A, r->X, r->Y, r->P, r->SP,
+	         (unsigned)(dot / 341 % 262), (unsigned)(dot % 341), (unsigned long long)cycle);
+}
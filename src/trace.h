@@ -0,0 +1,83 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include "cpu.h"
+
+#define TRACE_RING     (1 << 16)   // records; must be a power of 2
+#define TRACE_FIELDS   10          // record bytes before the cycle count
+#define TRACE_MAGIC    "6502TRC1"
+
+
+// One instruction, captured before it executes. 16 bytes, little-endian.
+typedef struct TraceRecord
+{
+	uint16_t PC;
+	uint8_t  opcode;
+	uint8_t  operand[2];
+	uint8_t  A, X, Y, P, SP;
+	uint16_t cycle_hi;
+	uint32_t cycle_lo;
+} TraceRecord;
+
+// Single-producer ring between the core and a writer thread, which
+// delta-compresses records against the previous one and writes them out
+typedef struct Trace
+{
+	TraceRecord ring[TRACE_RING];
+	_Atomic size_t head;   // next slot the core fills
+	_Atomic size_t tail;   // next slot the writer drains
+	_Atomic int    done;
+
+	pthread_t thread;
+	FILE *f;
+} Trace;
+
+typedef struct TraceReader
+{
+	FILE *f;
+	TraceRecord prev;
+} TraceReader;
+
+Trace *trace_open(FILE *);
+void trace_close(Trace *);
+
+int trace_reader_open(TraceReader *, FILE *);
+int trace_read(TraceReader *, TraceRecord *);
+uint64_t trace_cycle(const TraceRecord *);
+void trace_format(const TraceRecord *, char *, size_t);
+
+
+// Fill a record from the CPU as it is about to execute
+static inline void trace_record(TraceRecord *r, CPU *cpu)
+{
+	r->PC = cpu->reg.PC;
+	r->opcode = peek(cpu, cpu->reg.PC);
+	r->operand[0] = peek(cpu, cpu->reg.PC + 1);
+	r->operand[1] = peek(cpu, cpu->reg.PC + 2);
+	r->A = cpu->reg.A;
+	r->X = cpu->reg.X;
+	r->Y = cpu->reg.Y;
+	r->P = get_flags(cpu);
+	r->SP = cpu->reg.SP;
+	r->cycle_hi = cpu->total_cycles >> 32;
+	r->cycle_lo = (uint32_t)cpu->total_cycles;
+}
+
+static inline void trace_push(Trace *trace, CPU *cpu)
+{
+	size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+
+	// the writer is a whole ring behind; wait rather than drop records
+	while (head - atomic_load_explicit(&trace->tail, memory_order_acquire) == TRACE_RING)
+		sched_yield();
+
+	trace_record(&trace->ring[head & (TRACE_RING - 1)], cpu);
+	atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+#endif
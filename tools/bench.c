@@ -0,0 +1,165 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "cpu.h"
+#include "asm.h"
+#include "c64.h"
+
+#define BENCH_CYCLES  200000000ULL
+#define RANDOM_KERNELS 20000
+#define RANDOM_LINES   48
+
+// A CPU-bound kernel made of the loops games spend their time in: a 128-byte
+// copy through (zp),Y, a DEX delay loop and a store, forever
+static const char kernel[] =
+	"src = $10\n"
+	"dst = $12\n"
+	"start:  LDY #$00\n"
+	"copy:   LDA (src),Y\n"
+	"        STA (dst),Y\n"
+	"        INY\n"
+	"        CPY #$80\n"
+	"        BNE copy\n"
+	"        LDX #$10\n"
+	"delay:  DEX\n"
+	"        BNE delay\n"
+	"        LDA #$01\n"
+	"        STA $0300\n"
+	"        JMP start\n";
+
+// The same sort of loop on a C64 that banks BASIC in and out around every
+// access: $A000-$BFFF is read as RAM, then as ROM, and stored to (which lands
+// in the RAM under the ROM)
+static const char banked_kernel[] =
+	"        LDA #$37\n"      // set up the port as the KERNAL does: latch, then
+	"        STA $01\n"       // pins 0-3 and 5 as outputs
+	"        LDA #$2F\n"
+	"        STA $00\n"
+	"start:  LDX #$00\n"
+	"loop:   LDA #$36\n"      // BASIC out
+	"        STA $01\n"
+	"        LDA $A000,X\n"
+	"        LDY #$37\n"      // BASIC in
+	"        STY $01\n"
+	"        EOR $A000,X\n"
+	"        STA $A000,X\n"
+	"        INX\n"
+	"        BNE loop\n"
+	"        JMP start\n";
+
+// Instructions for random kernels; %d is replaced by a random byte
+static const char *random_lines[] =
+{
+	"LDA #%d", "LDX #%d", "LDY #%d", "ADC $%02X", "SBC ($%02X),Y", "STA $0%03X,X",
+	"AND #%d", "EOR $%02X,X", "ORA #%d", "CMP #%d", "ASL", "ROR $%02X",
+	"INX", "DEY", "INC $%02X", "CLC", "TAX", "PHA\n PLA",
+};
+
+static void run(uint8_t fusion)
+{
+	static Assembler as;
+	CPU *cpu = init_cpu();
+	if (assemble(&as, cpu, kernel, 0x8000) < 0)
+	{
+		fprintf(stderr, "[ERROR] %s; exiting...", as.error);
+		exit(EXIT_FAILURE);
+	}
+	cpu->memory[0x11] = 0x04;  // copy $0400 -> $0500
+	cpu->memory[0x13] = 0x05;
+	cpu->reg.PC = 0x8000;
+	cpu->fusion = fusion;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	run_until(cpu, BENCH_CYCLES);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	uint64_t dispatches = cpu->instructions - cpu->fused;
+	printf("%-18s %10lu instructions %10lu dispatches (%.2f per instruction) %7.1f M instructions/s\n",
+	       fusion ? "superinstructions" : "plain", (unsigned long)cpu->instructions, (unsigned long)dispatches,
+	       (double)dispatches / cpu->instructions, cpu->instructions / elapsed / 1e6);
+	delete_cpu(cpu);
+}
+
+static void run_banked(void)
+{
+	static Assembler as;
+	C64 *c64 = init_c64();
+	CPU *cpu = c64->cpu;
+	for (size_t i = 0; i < BASIC_SIZE; i++)
+		c64->basic[i] = (uint8_t)(i * 7);
+	if (assemble(&as, cpu, banked_kernel, 0xC000) < 0)
+	{
+		fprintf(stderr, "[ERROR] %s; exiting...", as.error);
+		exit(EXIT_FAILURE);
+	}
+	cpu->reg.PC = 0xC000;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	run_until(cpu, BENCH_CYCLES);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	printf("%-18s %10lu instructions %10lu bank flips                %7.1f M instructions/s\n",
+	       "banked (C64)", (unsigned long)cpu->instructions, (unsigned long)c64->flips,
+	       cpu->instructions / elapsed / 1e6);
+	delete_c64(c64);
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Generate, assemble and load random straight-line kernels ending in a loop
+static void assemble_random(void)
+{
+	static Assembler as;
+	static char source[RANDOM_LINES * 24 + 64];
+	CPU *cpu = init_cpu();
+	size_t bytes = 0;
+	srand(1);
+
+	double start = seconds();
+	for (int k = 0; k < RANDOM_KERNELS; k++)
+	{
+		int len = snprintf(source, sizeof(source), "top:\n");
+		for (int i = 0; i < RANDOM_LINES; i++)
+		{
+			len += snprintf(source + len, sizeof(source) - len, " ");
+			len += snprintf(source + len, sizeof(source) - len, random_lines[rand() % (sizeof(random_lines) / sizeof(*random_lines))], rand() & 0xFF);
+			len += snprintf(source + len, sizeof(source) - len, "\n");
+		}
+		snprintf(source + len, sizeof(source) - len, " DEX\n BNE top\n");
+
+		if (assemble(&as, cpu, source, 0x8000) < 0)
+		{
+			fprintf(stderr, "[ERROR] %s; exiting...", as.error);
+			exit(EXIT_FAILURE);
+		}
+		bytes += as.bytes;
+	}
+	double elapsed = seconds() - start;
+
+	printf("%-18s %10d kernels of %d lines (%lu bytes) %7.0f kernels/s\n", "random kernels", RANDOM_KERNELS,
+	       RANDOM_LINES + 2, (unsigned long)bytes, RANDOM_KERNELS / elapsed);
+	delete_cpu(cpu);
+}
+
+// Dispatch count and speed of the core with and without superinstructions and
+// with ROM banked in and out, and how fast test kernels can be generated and
+// assembled in-process
+int main(void)
+{
+	run(0);
+	run(1);
+	run_banked();
+	assemble_random();
+	return 0;
+}
@@ -0,0 +1,218 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "state.h"
+#include "trace.h"
+
+#define BISECT_WINDOW  32  // cycles left to single-step once bisection ends
+
+// Finds the first instruction where two runs of the same image disagree. Both
+// run in lockstep, compared by state fingerprint at every checkpoint; after the
+// first mismatch the interval since the last matching checkpoint is bisected by
+// restoring snapshots, then single-stepped to the exact instruction. The index
+// it reports counts instructions executed: idle-loop iterations the core
+// skipped (see cpu.c) aren't included, so it can be short of a trace's count.
+//   ./diverge -l C000 -s 16 -e C000 -a step -b fused nestest.nes
+// Configurations:
+//   step   one instruction_table lookup per instruction, no decode cache
+//   plain  the decoded dispatch loop without superinstructions
+//   fused  the decoded dispatch loop with superinstructions (main's default)
+
+typedef struct Side
+{
+	char *config;
+	CPU *cpu;
+	Snapshot *snap;
+} Side;
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-l load] [-s skip] [-e entry] [-a config] [-b config] [-k cycles] [-c cycles] image.bin\n", prog);
+	fprintf(stderr, "  -l addr    load address of the image (hex, default 8000)\n");
+	fprintf(stderr, "  -s bytes   skip this many bytes at the start of the file (e.g. 16 for an iNES header)\n");
+	fprintf(stderr, "  -e addr    start here (hex, default the load address)\n");
+	fprintf(stderr, "  -a config  first run: step, plain or fused (default step)\n");
+	fprintf(stderr, "  -b config  second run (default fused)\n");
+	fprintf(stderr, "  -k cycles  checkpoint interval (default 100000)\n");
+	fprintf(stderr, "  -c cycles  give up after this many cycles (default 1000000000)\n");
+	exit(EXIT_FAILURE);
+}
+
+static void setup(Side *side, char *config, uint8_t *image, size_t len, uint16_t load, uint16_t entry)
+{
+	CPU *cpu = init_cpu();
+
+	if (strcmp(config, "step") == 0)
+		cpu->single_step = 1;
+	else if (strcmp(config, "plain") == 0)
+		cpu->fusion = 0;
+	else if (strcmp(config, "fused") == 0)
+		cpu->fusion = 1;
+	else
+	{
+		fprintf(stderr, "[ERROR] Unknown configuration %s; exiting...", config);
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(&cpu->memory[load], image, len);
+	cpu->reg.PC = entry;
+
+	side->config = config;
+	side->cpu = cpu;
+	side->snap = calloc(1, sizeof(Snapshot));
+	snapshot_take(side->cpu, side->snap);
+}
+
+static int halted(CPU *cpu)
+{
+	return cpu->jammed || cpu->stop;
+}
+
+// one side halting where the other runs on is a divergence too
+static int same(Side *a, Side *b)
+{
+	return a->cpu->total_cycles == b->cpu->total_cycles && halted(a->cpu) == halted(b->cpu) &&
+	       state_equal(a->cpu, b->cpu);
+}
+
+static void report(Side *side, TraceRecord *before)
+{
+	char line[128];
+	CPU *cpu = side->cpu;
+
+	trace_format(before, line, sizeof(line));
+	printf("%s ran:  %s\n", side->config, line);
+	printf("%s then: PC:%04X", side->config, cpu->reg.PC);
+	if (cpu->stop)
+		printf(" (%s)", stop_reason(cpu->stop));
+	dump_cpu(cpu, stdout);
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	uint16_t load = 0x8000;
+	long entry = -1;
+	size_t skip = 0;
+	char *config_a = "step", *config_b = "fused";
+	uint64_t interval = 100000, limit = 1000000000ULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:s:e:a:b:k:c:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'l': load = strtol(optarg, NULL, 16); break;
+			case 's': skip = strtoul(optarg, NULL, 10); break;
+			case 'e': entry = strtol(optarg, NULL, 16); break;
+			case 'a': config_a = optarg; break;
+			case 'b': config_b = optarg; break;
+			case 'k': interval = strtoull(optarg, NULL, 10); break;
+			case 'c': limit = strtoull(optarg, NULL, 10); break;
+			default:  usage(argv[0]);
+		}
+	}
+	if (optind >= argc || interval == 0)
+		usage(argv[0]);
+
+	size_t len;
+	uint8_t *image = read_file_as_bytes(argv[optind], &len);
+	if (skip > len)
+		skip = len;
+	if (len - skip > (size_t)(ADDRESS_BYTES - load))
+		len = ADDRESS_BYTES - load + skip;
+
+	Side a, b;
+	setup(&a, config_a, image + skip, len - skip, load, entry >= 0 ? entry : load);
+	setup(&b, config_b, image + skip, len - skip, load, entry >= 0 ? entry : load);
+	free(image);
+
+	// lockstep, snapshotting both at every checkpoint that still matches
+	double start = seconds();
+	uint64_t lo = a.cpu->total_cycles, hi = 0;
+	unsigned long checkpoints = 0;
+	for (uint64_t target = lo + interval; lo < limit; target += interval)
+	{
+		run_until(a.cpu, target);
+		run_until(b.cpu, target);
+		checkpoints++;
+		if (!same(&a, &b))
+		{
+			hi = target;
+			break;
+		}
+		if (halted(a.cpu) && halted(b.cpu))
+		{
+			printf("no divergence: both %s at cycle %lu after %lu instructions\n",
+			       a.cpu->stop ? stop_reason(a.cpu->stop) : "jammed",
+			       (unsigned long)a.cpu->total_cycles, (unsigned long)a.cpu->instructions);
+			return 0;
+		}
+		snapshot_take(a.cpu, a.snap);
+		snapshot_take(b.cpu, b.snap);
+		lo = a.cpu->total_cycles;
+	}
+	if (!hi)
+	{
+		printf("no divergence in %lu cycles (%lu instructions)\n",
+		       (unsigned long)a.cpu->total_cycles, (unsigned long)a.cpu->instructions);
+		return 0;
+	}
+	double forward = seconds() - start;
+
+	// halve [lo, hi) until a few instructions are left
+	unsigned long rounds = 0;
+	while (hi - lo > BISECT_WINDOW)
+	{
+		uint64_t mid = lo + (hi - lo) / 2;
+		snapshot_restore(a.cpu, a.snap);
+		snapshot_restore(b.cpu, b.snap);
+		run_until(a.cpu, mid);
+		run_until(b.cpu, mid);
+		rounds++;
+
+		if (same(&a, &b))
+		{
+			snapshot_take(a.cpu, a.snap);
+			snapshot_take(b.cpu, b.snap);
+			lo = a.cpu->total_cycles;
+		}
+		else
+			hi = mid;
+	}
+
+	// then one instruction at a time
+	snapshot_restore(a.cpu, a.snap);
+	snapshot_restore(b.cpu, b.snap);
+	while (a.cpu->total_cycles <= hi)
+	{
+		TraceRecord before;
+		trace_record(&before, a.cpu);
+		uint64_t instructions = a.cpu->instructions;
+
+		run_until(a.cpu, a.cpu->total_cycles + 1);
+		run_until(b.cpu, b.cpu->total_cycles + 1);
+		if (same(&a, &b))
+			continue;
+
+		printf("first divergence: instruction %lu (not counting skipped idle iterations) at cycle %lu (%lu checkpoints in %.3f s, %lu bisection rounds in %.3f s)\n",
+		       (unsigned long)instructions + 1, (unsigned long)trace_cycle(&before), checkpoints, forward,
+		       rounds, seconds() - start - forward);
+		report(&a, &before);
+		report(&b, &before);
+		return 1;
+	}
+
+	fprintf(stderr, "[ERROR] Checkpoints differ but the rerun doesn't; is a run nondeterministic? exiting...");
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "state.h"
+
+#define MAX_INPUT      4096
+#define JAM_OPCODE     0x02
+#define VECTORS        0xFFFA  // NMI, reset and IRQ/BRK
+
+// Fuzzing harness for guest code. A raw binary image is loaded and its routine
+// called with each input copied into guest RAM; the routine returns with RTS
+// to the exit address, where a JAM opcode stops the CPU. Between cases only
+// the pages the guest stored to are restored from the baseline snapshot.
+//
+// Built with afl-clang-fast it runs in AFL++ persistent, shared-memory mode,
+// with guest edges going into AFL's coverage map. To keep host edges out of
+// the map, build with AFL_LLVM_DENYLIST naming every source file. AFL++ would
+// then size the map from the few host edges left, but guest edges index all
+// COVERAGE_SIZE entries, so the map size has to be set:
+//   make clean && AFL_LLVM_DENYLIST=deny.txt make fuzz CC=afl-clang-fast
+//   AFL_MAP_SIZE=65536 afl-fuzz -i in -o out -- ./fuzz -l 8000 -e 8000 -i 0200 parser.bin
+// Otherwise each file named after the image is run once and its outcome printed.
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+__AFL_FUZZ_INIT();
+extern uint8_t *__afl_area_ptr;
+extern uint32_t __afl_map_size;
+#endif
+
+typedef enum Outcome
+{
+	FUZZ_OK,
+	FUZZ_CRASH,   // illegal opcode or a stop reason
+	FUZZ_HANG     // still running when the cycle budget ran out
+} Outcome;
+
+typedef struct Harness
+{
+	CPU *cpu;
+	Snapshot *baseline;
+	uint16_t input_addr;
+	long     length_addr;   // 16-bit input length stored here, if >= 0
+	uint16_t max_input;
+	uint16_t exit_addr;
+	uint64_t budget;
+} Harness;
+
+static int overlaps(long addr, long first, long len)
+{
+	return addr >= first && addr < first + len;
+}
+
+// The JAM at the exit mustn't land in the vectors, the image, the input or its
+// length word, nor in the zero page or stack
+static uint16_t default_exit(Harness *h, long load, size_t image_len)
+{
+	for (long addr = VECTORS - 1; addr >= 0x0200; addr--)
+	{
+		if (overlaps(addr, load, image_len) || overlaps(addr, h->input_addr, h->max_input) ||
+		    (h->length_addr >= 0 && overlaps(addr, h->length_addr, 2)))
+			continue;
+		return addr;
+	}
+	fprintf(stderr, "[ERROR] No free address for the exit; give one with -x; exiting...");
+	exit(EXIT_FAILURE);
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "usage: %s [-l load] [-e entry] [-i input] [-L length] [-m max] [-x exit] [-c cycles] [-H] image.bin [inputs...]\n", prog);
+	fprintf(stderr, "  -l addr    load address of the image (hex, default 8000)\n");
+	fprintf(stderr, "  -e addr    routine to call (hex, default the load address)\n");
+	fprintf(stderr, "  -i addr    where each input is copied (hex, default 0200)\n");
+	fprintf(stderr, "  -L addr    store the input length here as a 16-bit word (hex)\n");
+	fprintf(stderr, "  -m bytes   longest input copied (default 256)\n");
+	fprintf(stderr, "  -x addr    return address; reaching it ends a case (hex, default the highest\n");
+	fprintf(stderr, "             address below the vectors not used by the image or input)\n");
+	fprintf(stderr, "  -c cycles  cycle budget per case before it counts as a hang (default 1000000)\n");
+	fprintf(stderr, "  -H         under AFL, report hangs by stalling until afl-fuzz times out\n");
+	exit(EXIT_FAILURE);
+}
+
+static Outcome run_case(Harness *h, const uint8_t *input, size_t len)
+{
+	CPU *cpu = h->cpu;
+
+	snapshot_restore(cpu, h->baseline);
+	cpu->prev_loc = 0;
+
+	if (len > h->max_input)
+		len = h->max_input;
+	for (size_t i = 0; i < len; i++)
+		write_byte(cpu, h->input_addr + i, input[i]);
+	if (h->length_addr >= 0)
+	{
+		write_byte(cpu, h->length_addr, len & 0xFF);
+		write_byte(cpu, h->length_addr + 1, len >> 8);
+	}
+
+	// nothing else can happen, so an idle loop skips straight to the budget
+	run_until(cpu, cpu->total_cycles + h->budget);
+
+	if (cpu->stop)
+		return FUZZ_CRASH;
+	if (cpu->jammed)
+		return cpu->reg.PC == h->exit_addr ? FUZZ_OK : FUZZ_CRASH;
+	return FUZZ_HANG;
+}
+
+int main(int argc, char **argv)
+{
+	Harness h = {.input_addr = 0x0200, .length_addr = -1, .max_input = 256, .budget = 1000000};
+	long load = 0x8000, entry = -1, exit_addr = -1;
+	int report_hangs = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:e:i:L:m:x:c:H")) != -1)
+	{
+		switch (opt)
+		{
+			case 'l': load = strtol(optarg, NULL, 16); break;
+			case 'e': entry = strtol(optarg, NULL, 16); break;
+			case 'i': h.input_addr = strtol(optarg, NULL, 16); break;
+			case 'L': h.length_addr = strtol(optarg, NULL, 16); break;
+			case 'm': h.max_input = strtol(optarg, NULL, 10); break;
+			case 'x': exit_addr = strtol(optarg, NULL, 16); break;
+			case 'c': h.budget = strtoull(optarg, NULL, 10); break;
+			case 'H': report_hangs = 1; break;
+			default:  usage(argv[0]);
+		}
+	}
+	if (optind >= argc || load < 0 || load > 0xFFFF)
+		usage(argv[0]);
+	if (h.max_input > MAX_INPUT)
+		h.max_input = MAX_INPUT;
+
+	// baseline: image loaded, routine about to run with the exit address on the stack
+	size_t image_len;
+	uint8_t *image = read_file_as_bytes(argv[optind++], &image_len);
+	if (image_len > (size_t)(ADDRESS_BYTES - load))
+		image_len = ADDRESS_BYTES - load;
+
+	h.cpu = init_cpu();
+	memcpy(&h.cpu->memory[load], image, image_len);
+	free(image);
+	h.exit_addr = exit_addr >= 0 ? (uint16_t)exit_addr : default_exit(&h, load, image_len);
+	h.cpu->memory[h.exit_addr] = JAM_OPCODE;
+	stack_push_word(h.cpu, h.exit_addr - 1);
+	h.cpu->reg.PC = entry >= 0 ? (uint16_t)entry : (uint16_t)load;
+
+	h.baseline = calloc(1, sizeof(Snapshot));
+	snapshot_take(h.cpu, h.baseline);
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+	__AFL_INIT();  // may move __afl_area_ptr to the shared map
+	if (__afl_map_size < COVERAGE_SIZE)
+	{
+		fprintf(stderr, "[ERROR] AFL map is %u entries, guest edges need %u; run with AFL_MAP_SIZE=%u; exiting...",
+		        __afl_map_size, COVERAGE_SIZE, COVERAGE_SIZE);
+		exit(EXIT_FAILURE);
+	}
+	h.cpu->coverage = __afl_area_ptr;
+	uint8_t *buf = __AFL_FUZZ_TESTCASE_BUF;
+
+	while (__AFL_LOOP(100000))
+	{
+		Outcome outcome = run_case(&h, buf, __AFL_FUZZ_TESTCASE_LEN);
+		if (outcome == FUZZ_CRASH)
+			abort();
+		if (outcome == FUZZ_HANG && report_hangs)
+			for (;;)
+				pause();
+	}
+#else
+	(void) report_hangs;
+	static const char *names[] = {"ok", "crash", "hang"};
+	static uint8_t coverage[COVERAGE_SIZE];
+	h.cpu->coverage = coverage;
+
+	for (; optind < argc; optind++)
+	{
+		size_t len;
+		uint8_t *input = read_file_as_bytes(argv[optind], &len);
+
+		memset(coverage, 0, sizeof(coverage));
+		Outcome outcome = run_case(&h, input, len);
+
+		size_t edges = 0;
+		for (size_t i = 0; i < COVERAGE_SIZE; i++)
+			edges += coverage[i] != 0;
+
+		printf("%s: %s", argv[optind], names[outcome]);
+		if (h.cpu->stop)
+			printf(" (%s)", stop_reason(h.cpu->stop));
+		else if (outcome == FUZZ_CRASH)
+			printf(" (illegal opcode $%02X)", h.cpu->memory[h.cpu->reg.PC]);
+		printf(" at $%04X, %lu instructions, %zu edges\n", h.cpu->reg.PC,
+		       (unsigned long)(h.cpu->instructions - h.baseline->instructions), edges);
+		free(input);
+	}
+#endif
+
+	free(h.baseline);
+	delete_cpu(h.cpu);
+	return 0;
+}
@@ -0,0 +1,33 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "trace.h"
+
+// Expand a binary trace into nestest.log-style text on stdout
+int main(int argc, char **argv)
+{
+	FILE *f = argc > 1 ? fopen(argv[1], "rb") : stdin;
+	if (f == NULL)
+	{
+		perror("fopen");
+		exit(EXIT_FAILURE);
+	}
+
+	TraceReader reader;
+	if (trace_reader_open(&reader, f) != 0)
+	{
+		fprintf(stderr, "[ERROR] Not a trace file; exiting...");
+		exit(EXIT_FAILURE);
+	}
+
+	TraceRecord r;
+	char line[128];
+	while (trace_read(&reader, &r))
+	{
+		trace_format(&r, line, sizeof(line));
+		puts(line);
+	}
+
+	fclose(f);
+	return 0;
+}